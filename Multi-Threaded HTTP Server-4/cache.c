@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "httpserver.h"
+#include "cache.h"
+#include "lock.h"
+
+#define CACHE_SHARDS     16 // power of two
+#define CACHE_BUCKETS    256 // per shard, power of two
+#define CACHE_MAX_OBJECT (1024 * 1024) // bigger files are streamed from disk
+
+#define CLOSE_HEADER "Connection: close\r\n"
+
+TAILQ_HEAD(entryList, CacheEntry);
+
+typedef struct Shard {
+    pthread_mutex_t mutex;
+    CacheEntry *buckets[CACHE_BUCKETS];
+    struct entryList lru; // least recently used first
+    size_t bytes;
+    size_t entries;
+} Shard;
+
+typedef struct Table {
+    Shard shards[CACHE_SHARDS];
+    size_t shard_capacity; // 0: off
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong stale; // misses that found an out-of-date entry
+    atomic_ulong evictions;
+} Table;
+
+static Table content; // keyed by path
+static Table maps; // -m, keyed by device and inode
+static atomic_ulong invalidations;
+
+static void table_init(Table *t, size_t capacity) {
+    t->shard_capacity = capacity / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&t->shards[i].mutex, NULL);
+        TAILQ_INIT(&t->shards[i].lru);
+    }
+}
+
+void cache_init(size_t capacity) {
+    table_init(&content, capacity);
+}
+
+void cache_map_init(size_t capacity) {
+    table_init(&maps, capacity);
+}
+
+bool cache_enabled(void) {
+    return content.shard_capacity > 0 || maps.shard_capacity > 0;
+}
+
+bool cache_admits(off_t size) {
+    return content.shard_capacity > 0 && size <= CACHE_MAX_OBJECT
+           && (size_t) size + HEADER_SIZE <= content.shard_capacity;
+}
+
+bool cache_map_admits(off_t size) {
+    return maps.shard_capacity > 0 && size > 0 && !cache_admits(size)
+           && (size_t) size + HEADER_SIZE <= maps.shard_capacity;
+}
+
+static uint32_t inode_hash(dev_t dev, ino_t ino) {
+    return (uint32_t) (((uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 32);
+}
+
+static Shard *shard_of(Table *t, uint32_t hash) {
+    return &t->shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static CacheEntry **bucket(Shard *s, uint32_t hash) {
+    return &s->buckets[(hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1)];
+}
+
+// The entry with e's key: its path, or its file for a mapping.
+static CacheEntry *find(Shard *s, const CacheEntry *key) {
+    for (CacheEntry *e = *bucket(s, key->hash); e != NULL; e = e->next) {
+        if (key->mapped ? e->dev == key->dev && e->ino == key->ino
+                        : strcmp(e->path, key->path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Take e out of the shard; the shard's reference is the caller's to drop.
+static void unlink_entry(Shard *s, CacheEntry *e) {
+    CacheEntry **p = bucket(s, e->hash);
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    TAILQ_REMOVE(&s->lru, e, lru);
+    s->bytes -= e->len;
+    s->entries--;
+}
+
+static bool matches(const CacheEntry *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size
+           && e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static CacheEntry *lookup(Table *t, const CacheEntry *key, const struct stat *st) {
+    if (t->shard_capacity == 0) {
+        return NULL;
+    }
+    Shard *s = shard_of(t, key->hash);
+
+    pthread_mutex_lock(&s->mutex);
+    CacheEntry *e = find(s, key);
+    if (e != NULL && matches(e, st)) {
+        TAILQ_REMOVE(&s->lru, e, lru);
+        TAILQ_INSERT_TAIL(&s->lru, e, lru);
+        atomic_fetch_add(&e->refs, 1);
+        pthread_mutex_unlock(&s->mutex);
+        atomic_fetch_add(&t->hits, 1);
+        return e;
+    }
+    if (e != NULL) { // the file changed behind our back
+        unlink_entry(s, e);
+        atomic_fetch_add(&t->stale, 1);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    atomic_fetch_add(&t->misses, 1);
+    if (e != NULL) {
+        cache_release(e);
+    }
+    return NULL;
+}
+
+CacheEntry *cache_lookup(const char *path, const struct stat *st) {
+    CacheEntry key = { .hash = path_hash(path) };
+    snprintf(key.path, sizeof(key.path), "%s", path);
+    return lookup(&content, &key, st);
+}
+
+CacheEntry *cache_map_lookup(const struct stat *st) {
+    CacheEntry key = {
+        .hash = inode_hash(st->st_dev, st->st_ino), .dev = st->st_dev, .ino = st->st_ino, .mapped = true
+    };
+    return lookup(&maps, &key, st);
+}
+
+// A new entry with the header; the body goes after it unless it is mapped.
+static CacheEntry *new_entry(const struct stat *st, bool mapped) {
+    char head[HEADER_SIZE];
+    size_t head_len = ok_header(st->st_size, head);
+
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->len = head_len + 2 + st->st_size;
+    e->data = malloc(mapped ? head_len + 2 : e->len);
+    if (e->data == NULL) {
+        free(e);
+        return NULL;
+    }
+    memcpy(e->data, head, head_len);
+    memcpy(e->data + head_len, "\r\n", 2);
+    e->head_len = head_len;
+    e->body = e->data + head_len + 2;
+    e->mapped = mapped;
+
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    atomic_init(&e->refs, 1);
+    return e;
+}
+
+CacheEntry *cache_alloc(const char *path, const struct stat *st) {
+    CacheEntry *e = new_entry(st, false);
+    if (e != NULL) {
+        snprintf(e->path, sizeof(e->path), "%s", path);
+        e->hash = path_hash(e->path);
+    }
+    return e;
+}
+
+static void insert(Table *t, CacheEntry *e) {
+    Shard *s = shard_of(t, e->hash);
+    CacheEntry *dropped = NULL; // chained through next, released after unlocking
+
+    pthread_mutex_lock(&s->mutex);
+    CacheEntry *old = find(s, e);
+    if (old != NULL) {
+        unlink_entry(s, old);
+        old->next = dropped;
+        dropped = old;
+    }
+    while (s->bytes + e->len > t->shard_capacity && !TAILQ_EMPTY(&s->lru)) {
+        CacheEntry *victim = TAILQ_FIRST(&s->lru);
+        unlink_entry(s, victim);
+        victim->next = dropped;
+        dropped = victim;
+        atomic_fetch_add(&t->evictions, 1);
+    }
+    atomic_fetch_add(&e->refs, 1);
+    CacheEntry **b = bucket(s, e->hash);
+    e->next = *b;
+    *b = e;
+    TAILQ_INSERT_TAIL(&s->lru, e, lru);
+    s->bytes += e->len;
+    s->entries++;
+    pthread_mutex_unlock(&s->mutex);
+
+    while (dropped != NULL) {
+        CacheEntry *next = dropped->next;
+        cache_release(dropped);
+        dropped = next;
+    }
+}
+
+void cache_insert(CacheEntry *e) {
+    insert(&content, e);
+}
+
+CacheEntry *cache_fill(const char *path, int fd, const struct stat *st) {
+    CacheEntry *e = cache_alloc(path, st);
+    if (e == NULL) {
+        return NULL;
+    }
+    char *body = e->body;
+    off_t got = 0;
+    while (got < st->st_size) {
+        ssize_t n = pread(fd, body + got, st->st_size - got, got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            cache_release(e);
+            return NULL;
+        }
+        got += n;
+    }
+    cache_insert(e);
+    return e;
+}
+
+// The pages come from the page cache as the response goes out: read ahead now,
+// and let them go behind the reader.
+CacheEntry *cache_map(int fd, const struct stat *st) {
+    CacheEntry *e = new_entry(st, true);
+    if (e == NULL) {
+        return NULL;
+    }
+    void *addr = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        e->mapped = false;
+        cache_release(e);
+        return NULL;
+    }
+    madvise(addr, st->st_size, MADV_SEQUENTIAL);
+    madvise(addr, st->st_size, MADV_WILLNEED);
+    e->body = addr;
+    e->hash = inode_hash(st->st_dev, st->st_ino);
+    insert(&maps, e);
+    return e;
+}
+
+void cache_release(CacheEntry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        if (e->mapped) {
+            munmap(e->body, e->size);
+        }
+        free(e->data);
+        free(e);
+    }
+}
+
+// A mapping needs no invalidation: a PUT renames a new inode over the path, and
+// an APPEND changes the size and mtime that every lookup checks.
+void cache_invalidate(const char *path) {
+    if (content.shard_capacity == 0) {
+        return;
+    }
+    CacheEntry key = { .hash = path_hash(path) };
+    snprintf(key.path, sizeof(key.path), "%s", path);
+    Shard *s = shard_of(&content, key.hash);
+
+    pthread_mutex_lock(&s->mutex);
+    CacheEntry *e = find(s, &key);
+    if (e != NULL) {
+        unlink_entry(s, e);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    if (e != NULL) {
+        atomic_fetch_add(&invalidations, 1);
+        cache_release(e);
+    }
+}
+
+size_t cache_reply_len(const CacheEntry *e, bool conn_close) {
+    return e->len + (conn_close ? strlen(CLOSE_HEADER) : 0);
+}
+
+int cache_iov(const CacheEntry *e, bool conn_close, size_t off, struct iovec iov[CACHE_IOV]) {
+    // header lines, optional Connection: close, blank line, body
+    struct iovec parts[CACHE_IOV] = {
+        { e->data, e->head_len },
+        { CLOSE_HEADER, conn_close ? strlen(CLOSE_HEADER) : 0 },
+        { e->data + e->head_len, 2 },
+        { e->body, e->size },
+    };
+    int n = 0;
+    for (int i = 0; i < CACHE_IOV; i++) {
+        if (off >= parts[i].iov_len) {
+            off -= parts[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *) parts[i].iov_base + off;
+        iov[n].iov_len = parts[i].iov_len - off;
+        off = 0;
+        n++;
+    }
+    return n;
+}
+
+int cache_send(int fd, const CacheEntry *e, bool conn_close, size_t *off) {
+    size_t total = cache_reply_len(e, conn_close);
+    while (*off < total) {
+        struct iovec iov[CACHE_IOV];
+        ssize_t n = writev(fd, iov, cache_iov(e, conn_close, *off, iov));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        *off += n;
+    }
+    return 0;
+}
+
+static void table_size(Table *t, size_t *entries, size_t *bytes) {
+    *entries = *bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&t->shards[i].mutex);
+        *entries += t->shards[i].entries;
+        *bytes += t->shards[i].bytes;
+        pthread_mutex_unlock(&t->shards[i].mutex);
+    }
+}
+
+void cache_report(void) {
+    size_t entries, bytes;
+    table_size(&content, &entries, &bytes);
+    warnx("cache: entries=%zu bytes=%zu hits=%lu misses=%lu stale=%lu evictions=%lu "
+          "invalidations=%lu",
+        entries, bytes, atomic_load(&content.hits), atomic_load(&content.misses),
+        atomic_load(&content.stale), atomic_load(&content.evictions),
+        atomic_load(&invalidations));
+    if (maps.shard_capacity > 0) {
+        table_size(&maps, &entries, &bytes);
+        warnx("mappings: entries=%zu bytes=%zu hits=%lu misses=%lu stale=%lu evictions=%lu",
+            entries, bytes, atomic_load(&maps.hits), atomic_load(&maps.misses),
+            atomic_load(&maps.stale), atomic_load(&maps.evictions));
+    }
+}
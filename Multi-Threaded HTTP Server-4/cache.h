@@ -0,0 +1,80 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// In-memory cache of small, hot GET bodies, keyed by path and sharded by its
+// hash. Each shard is an LRU list bounded by bytes. An entry holds the whole
+// 200 response, header included, so a hit is one stat() and one writev().
+// Entries are checked against the file's device, inode, mtime and size on
+// every lookup, and PUT/APPEND drop them outright.
+//
+// -m adds a second table of read-only mappings of the files the content cache
+// does not take, keyed by device and inode and bounded by mapped bytes. A hit
+// there is one stat() and one writev() straight from the page cache.
+
+#define CACHE_IOV 4 // most iovecs cache_iov() fills
+
+typedef struct CacheEntry {
+    char path[100];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    uint32_t hash; // of the path, or of device and inode for a mapping
+    atomic_int refs; // the shard's reference plus one per response being sent
+    char *data; // "HTTP/1.1 200 OK\r\nContent-Length: N\r\n" "\r\n", then the body unless mapped
+    size_t head_len; // bytes before the blank line
+    char *body; // size bytes, in data or mapped from the file
+    bool mapped;
+    size_t len; // head_len + 2 + size
+
+    // owned by the shard
+    TAILQ_ENTRY(CacheEntry) lru;
+    struct CacheEntry *next; // hash chain
+} CacheEntry;
+
+// capacity: total bytes over all shards; 0 turns the cache off.
+void cache_init(size_t capacity);
+bool cache_enabled(void);
+// Whether a file of this size may be cached.
+bool cache_admits(off_t size);
+
+// A referenced entry for path if it still matches st, else NULL.
+CacheEntry *cache_lookup(const char *path, const struct stat *st);
+// A new entry (one reference, not yet visible) with room for st->st_size body bytes.
+CacheEntry *cache_alloc(const char *path, const struct stat *st);
+// Publish a filled entry, replacing any older one and evicting to fit.
+void cache_insert(CacheEntry *e);
+// Read fd (st describes it) into a new entry and publish it; NULL on failure.
+CacheEntry *cache_fill(const char *path, int fd, const struct stat *st);
+void cache_release(CacheEntry *e);
+// The file changed (PUT/APPEND): forget it.
+void cache_invalidate(const char *path);
+
+// -m: capacity of the mapping table in bytes over all shards; 0 turns it off.
+void cache_map_init(size_t capacity);
+// Whether a file of this size may be mapped (the content cache gets first pick).
+bool cache_map_admits(off_t size);
+// A referenced mapping of the file st describes if it is still current, else NULL.
+CacheEntry *cache_map_lookup(const struct stat *st);
+// Map fd (st describes it) and publish the mapping; NULL on failure.
+CacheEntry *cache_map(int fd, const struct stat *st);
+
+// Bytes of the response, with or without a "Connection: close" header.
+size_t cache_reply_len(const CacheEntry *e, bool conn_close);
+// The part of the response from byte off on, as up to CACHE_IOV iovecs; returns the count.
+int cache_iov(const CacheEntry *e, bool conn_close, size_t off, struct iovec iov[CACHE_IOV]);
+// writev() the response from *off on, advancing *off. Returns 0 once it is
+// all out, -1 on error (EAGAIN from a non-blocking socket included).
+int cache_send(int fd, const CacheEntry *e, bool conn_close, size_t *off);
+
+// Print the hit/miss/eviction counters (and the mapping table's) to stderr.
+void cache_report(void);
+
+#endif
@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "httpserver.h"
+#include "cache.h"
+#include "event.h"
+#include "io.h"
+#include "lock.h"
+#include "metrics.h"
+#include "parser.h"
+
+// epoll:
+// https://man7.org/linux/man-pages/man7/epoll.7.html
+
+#define MAX_EVENTS 256
+#define CHUNK_SIZE (64 * 1024)
+
+typedef enum connState {
+    PARSE, // collecting the request header
+    LOCK_WAIT, // another request holds the file's lock (to open, or to commit a
+               // body once tmp_path is set); retried once the lock is released
+    READ_BODY, // copying the PUT/APPEND body from the socket to the (temp) file
+    WRITE_RESPONSE, // sending the response header and, for GET, the file
+} connState;
+
+typedef struct Conn {
+    int fd;
+    uint32_t events; // what epoll is currently watching for
+    uint64_t last; // last time the connection made progress (ms)
+    TAILQ_ENTRY(Conn) idle; // worker's connections, least recently active first
+    TAILQ_ENTRY(Conn) wait; // on the worker's LOCK_WAIT list
+    bool parked;
+    bool served; // has answered a request
+    connState state;
+    Request req;
+    Parser parser;
+
+    char buf[BUF_SIZE]; // request header, start of the body, maybe pipelined requests
+    size_t len;
+
+    int file; // file being sent (GET) or written (PUT/APPEND), -1 if none
+    size_t remaining; // READ_BODY: body bytes still expected
+    off_t offset; // WRITE_RESPONSE: next file byte to send
+    size_t file_left; // WRITE_RESPONSE: file bytes still to send
+    int status; // READ_BODY: status to send once the body is stored
+    CacheEntry *hit; // WRITE_RESPONSE: cached response being sent instead of out/file
+    size_t hit_off; // bytes of it already sent
+
+    const char *out; // response header (and status body): head, or a prebuilt reply
+    char head[HEADER_SIZE];
+    size_t out_len;
+    size_t out_off;
+} Conn;
+
+TAILQ_HEAD(connList, Conn);
+
+typedef struct Worker {
+    int epfd;
+    struct connList conns; // every connection, least recently active first
+    struct connList waiting; // connections in LOCK_WAIT
+    bool draining; // no longer accepting; returns once conns is empty
+} Worker;
+
+// epoll data of the drain eventfd (the listener's is NULL)
+static char drain_tag;
+// and of the worker's eventfd that a released path lock writes (see lock.h)
+static char wake_tag;
+static __thread int wake_fd;
+
+static void conn_close(Worker *w, Conn *c) {
+    TAILQ_REMOVE(&w->conns, c, idle);
+    if (c->parked) {
+        TAILQ_REMOVE(&w->waiting, c, wait);
+    }
+    unlock_request(&c->req);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->file >= 0) {
+        close_get(&c->req, c->file); // or a PUT/APPEND's file
+    }
+    if (c->hit != NULL) {
+        cache_release(c->hit);
+    }
+    remove_temp(&c->req);
+    free(c);
+}
+
+// Wait for readability while receiving and for writability while responding;
+// nothing while waiting for a lock.
+static void conn_watch(int epfd, Conn *c) {
+    uint32_t events = c->state == WRITE_RESPONSE ? EPOLLOUT : c->state == LOCK_WAIT ? 0 : EPOLLIN;
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+static uint64_t now_ms(void) {
+    return metrics_now() / 1000000;
+}
+
+// Ready for the next request on this connection.
+static void conn_reset(Conn *c) {
+    c->state = PARSE;
+    memset(&c->req, 0, sizeof(c->req));
+    c->req.socket = c->fd;
+    parser_init(&c->parser);
+    c->file = -1;
+    c->remaining = 0;
+    c->offset = 0;
+    c->file_left = 0;
+    c->out_len = 0;
+    c->out_off = 0;
+    c->hit = NULL;
+}
+
+// The current request is done: keep the bytes that follow it (a pipelined
+// request) and start over. Returns -1 when the connection has to close.
+static int next_request(Conn *c) {
+    unlock_request(&c->req);
+    metrics_done(&c->req);
+    if (c->req.conn_close) {
+        return -1;
+    }
+    size_t used = request_size(&c->req);
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+    c->served = true;
+    conn_reset(c);
+    return 0;
+}
+
+// Queue a response; file (if >= 0) is the GET body sent after the header.
+static void respond(Conn *c, int status, int file, size_t file_len) {
+    if (file >= 0) {
+        c->out = c->head;
+        c->out_len = get_response(&c->req, c->head);
+    } else {
+        Slice reply = status_response(&c->req, status);
+        c->out = reply.ptr;
+        c->out_len = reply.len;
+    }
+    c->out_off = 0;
+    c->file = file;
+    c->offset = 0;
+    c->file_left = file_len;
+    c->state = WRITE_RESPONSE;
+}
+
+// Send a cached 200 (header and body in one buffer) instead of out + file.
+static void respond_cached(Conn *c, CacheEntry *e) {
+    log_response(&c->req, 200);
+    c->hit = e;
+    c->hit_off = 0;
+    c->state = WRITE_RESPONSE;
+}
+
+// Lock and open the file, then reply (GET) or start reading the body (PUT/APPEND).
+// The worker must never block, so a busy lock parks the connection in LOCK_WAIT.
+// A staged body (a PUT's, most APPENDs') goes to a temp file and needs no lock
+// until commit_body().
+// Returns -1 when the connection should be closed.
+static int open_request(Conn *c) {
+    int status = 0;
+    if (!body_staged(&c->req) && !trylock_request_notify(&c->req, wake_fd)) {
+        c->state = LOCK_WAIT;
+        return 0;
+    }
+
+    if (c->req.method == GET) {
+        int file;
+        CacheEntry *e = open_cached(&c->req, &file, &status);
+        if (e != NULL) {
+            respond_cached(c, e);
+        } else if (file < 0) {
+            respond(c, status, -1, 0);
+        } else {
+            respond(c, 200, file, c->req.read_len);
+        }
+        return 0;
+    }
+
+    int file = open_put_append(&c->req, &status);
+    if (file < 0) {
+        discard_body(&c->req);
+        if (status != 0) {
+            respond(c, status, -1, 0);
+            return 0;
+        }
+        return next_request(c);
+    }
+
+    size_t buffered = c->req.bdy_len < c->req.cnt_len ? c->req.bdy_len : c->req.cnt_len;
+    if (write_all(file, c->req.msg_bdy, buffered) < 0) {
+        close(file);
+        remove_temp(&c->req);
+        discard_body(&c->req);
+        respond(c, 500, -1, 0);
+        return 0;
+    }
+    c->file = file;
+    c->status = status;
+    c->remaining = c->req.cnt_len - buffered;
+    c->state = READ_BODY;
+    return 0;
+}
+
+// The body is in its temp file: commit it (rename or copy) under the path lock.
+static int commit_body(Conn *c) {
+    if (!trylock_request_notify(&c->req, wake_fd)) {
+        c->state = LOCK_WAIT;
+        return 0;
+    }
+    respond(c, commit_temp(&c->req), -1, 0);
+    return 0;
+}
+
+// Returns -1 when the connection should be closed.
+static int start_request(Conn *c) {
+    if (c->req.method != PUT && c->req.method != APPEND) {
+        discard_body(&c->req);
+    }
+    if (!check_format(&c->req)) {
+        respond(c, 400, -1, 0);
+        return 0;
+    }
+    if (c->req.method != GET && c->req.method != PUT && c->req.method != APPEND) {
+        respond(c, 501, -1, 0);
+        return 0;
+    }
+    return open_request(c);
+}
+
+// Returns -1 when the connection should be closed.
+static int on_parse(Conn *c) {
+    for (;;) {
+        // a pipelined request may already be in the buffer
+        parseResult rc = metrics_parse(&c->parser, c->buf, c->len, &c->req);
+        if (rc == PARSE_DONE) {
+            if (start_request(c) < 0) {
+                return -1;
+            }
+            if (c->state != PARSE) {
+                return 0;
+            }
+            continue; // no reply was needed, look at the next request
+        }
+        if (rc == PARSE_ERROR || c->len == BUF_SIZE) {
+            c->req.conn_close = true; // the next request cannot be found
+            respond(c, 400, -1, 0);
+            return 0;
+        }
+
+        ssize_t n = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        c->len += n;
+    }
+}
+
+static int on_read_body(Conn *c) {
+    char chunk[CHUNK_SIZE];
+    while (c->remaining > 0) {
+        size_t want = c->remaining < CHUNK_SIZE ? c->remaining : CHUNK_SIZE;
+        ssize_t n = read(c->fd, chunk, want);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) { // client went away before sending Content-Length bytes
+            return -1;
+        }
+        if (write_all(c->file, chunk, n) < 0) {
+            close(c->file);
+            remove_temp(&c->req);
+            c->req.conn_close = true; // rest of the body is still on the wire
+            respond(c, 500, -1, 0);
+            return 0;
+        }
+        c->remaining -= n;
+    }
+    if (sync_file(&c->req, c->file) < 0) {
+        c->status = 500;
+        remove_temp(&c->req);
+    }
+    close(c->file);
+    c->file = -1;
+    if (c->req.tmp_path[0] != '\0') {
+        return commit_body(c);
+    }
+    respond(c, c->status, -1, 0);
+    return 0;
+}
+
+static int on_write(Conn *c) {
+    if (c->hit != NULL) {
+        if (cache_send(c->fd, c->hit, c->req.conn_close, &c->hit_off) < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        cache_release(c->hit);
+        c->hit = NULL;
+        return next_request(c);
+    }
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(
+            c->fd, c->out + c->out_off, c->out_len - c->out_off, c->file_left ? MSG_MORE : 0);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+    while (c->file_left > 0) {
+        size_t want = c->file_left < CHUNK_SIZE * 16 ? c->file_left : CHUNK_SIZE * 16;
+        ssize_t n = sendfile(c->fd, c->file, &c->offset, want);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) { // file shrank underneath us
+            return -1;
+        }
+        c->file_left -= n;
+    }
+    if (c->file >= 0) {
+        close_get(&c->req, c->file);
+        c->file = -1;
+    }
+    return next_request(c);
+}
+
+// Drive the state machine until it needs to wait for the socket or a lock.
+static void drive(Worker *w, Conn *c) {
+    connState before;
+    int rc = 0;
+    do {
+        before = c->state;
+        switch (c->state) {
+        case PARSE: rc = on_parse(c); break;
+        case LOCK_WAIT: rc = c->req.tmp_path[0] ? commit_body(c) : open_request(c); break;
+        case READ_BODY: rc = on_read_body(c); break;
+        case WRITE_RESPONSE: rc = on_write(c); break;
+        }
+    } while (rc == 0 && c->state != before);
+
+    if (rc < 0) {
+        conn_close(w, c);
+        return;
+    }
+    if (c->state == LOCK_WAIT && !c->parked) {
+        TAILQ_INSERT_TAIL(&w->waiting, c, wait);
+        c->parked = true;
+    } else if (c->state != LOCK_WAIT && c->parked) {
+        TAILQ_REMOVE(&w->waiting, c, wait);
+        c->parked = false;
+    }
+    conn_watch(w->epfd, c);
+}
+
+static void on_accept(Worker *w, int listenfd) {
+    for (int i = 0; i < LISTEN_BACKLOG; i++) { // the rest is still readable next round
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                warn("accept error");
+            }
+            return;
+        }
+        Conn *c = malloc(sizeof(Conn));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->parked = false;
+        c->served = false;
+        c->len = 0;
+        c->req.lock = NULL;
+        conn_reset(c);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->last = now_ms();
+        TAILQ_INSERT_TAIL(&w->conns, c, idle);
+    }
+}
+
+// The drain started: take what is left in the backlog and leave the listener.
+static void stop_accepting(Worker *w, int listenfd) {
+    on_accept(w, listenfd);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, listenfd, NULL);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, drain_fd(), NULL);
+    stopped_accepting();
+    w->draining = true;
+}
+
+// Draining: close the connections that have been idle between requests for
+// DRAIN_IDLE_MS. Only the head of the list is that old.
+static void close_idle(Worker *w, uint64_t now) {
+    Conn *c, *next;
+    for (c = TAILQ_FIRST(&w->conns); c != NULL && c->last + DRAIN_IDLE_MS <= now; c = next) {
+        next = TAILQ_NEXT(c, idle);
+        if (c->state == PARSE && c->len == 0 && c->served) {
+            conn_close(w, c);
+        }
+    }
+}
+
+void *event_worker(void *arg) {
+    int listenfd = *(int *) arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        err(EXIT_FAILURE, "epoll_create1");
+    }
+    // EPOLLEXCLUSIVE: a new connection wakes one worker, not all of them
+    struct epoll_event lev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &lev) < 0) {
+        err(EXIT_FAILURE, "epoll_ctl");
+    }
+    // every worker hears about the drain
+    struct epoll_event dev = { .events = EPOLLIN, .data.ptr = &drain_tag };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, drain_fd(), &dev) < 0) {
+        err(EXIT_FAILURE, "epoll_ctl");
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+    if (wake_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &wev) < 0) {
+        err(EXIT_FAILURE, "eventfd");
+    }
+
+    Worker w = { .epfd = epfd };
+    TAILQ_INIT(&w.conns);
+    TAILQ_INIT(&w.waiting);
+    struct epoll_event events[MAX_EVENTS];
+    while (!w.draining || !TAILQ_EMPTY(&w.conns)) {
+        // wake up once a second to close idle connections (more often while
+        // draining); a released lock wakes the worker through wake_fd
+        int timeout = w.draining ? DRAIN_IDLE_MS / 10 : idle_timeout > 0 ? 1000 : -1;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        uint64_t now = now_ms();
+        bool drain_seen = false;
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                if (!w.draining) {
+                    on_accept(&w, listenfd);
+                }
+                continue;
+            }
+            if (c == (Conn *) &drain_tag) {
+                drain_seen = true; // after the batch, which may hold events of idle connections
+                continue;
+            }
+            if (c == (Conn *) &wake_tag) {
+                uint64_t count;
+                read(wake_fd, &count, sizeof(count)); // the waiting list is retried below
+                continue;
+            }
+            c->last = now;
+            TAILQ_REMOVE(&w.conns, c, idle);
+            TAILQ_INSERT_TAIL(&w.conns, c, idle);
+            drive(&w, c);
+        }
+
+        if (drain_seen && !w.draining) {
+            stop_accepting(&w, listenfd);
+        }
+        if (w.draining) {
+            close_idle(&w, now);
+        }
+
+        // retry the connections whose file was locked (each registers for a
+        // wakeup again if it still is)
+        Conn *c, *next;
+        for (c = TAILQ_FIRST(&w.waiting); c != NULL; c = next) {
+            next = TAILQ_NEXT(c, wait);
+            c->last = now;
+            TAILQ_REMOVE(&w.conns, c, idle);
+            TAILQ_INSERT_TAIL(&w.conns, c, idle);
+            drive(&w, c);
+        }
+
+        // the list is ordered by activity, so only its head can have expired;
+        // a connection waiting for a lock is not idle, its client is waiting too
+        for (c = TAILQ_FIRST(&w.conns);
+             idle_timeout > 0 && c != NULL && c->last + (uint64_t) idle_timeout * 1000 <= now;
+             c = next) {
+            next = TAILQ_NEXT(c, idle);
+            if (!c->parked) {
+                conn_close(&w, c);
+            }
+        }
+    }
+    lock_forget(wake_fd);
+    close(wake_fd);
+    close(epfd);
+    return NULL;
+}
@@ -0,0 +1,4 @@
+// Event-driven engine (-e epoll): every worker runs its own epoll loop over
+// non-blocking sockets, accepting from the shared listening socket (or, with
+// -a, its own). arg points at the (non-blocking) listening socket.
+void *event_worker(void *arg);
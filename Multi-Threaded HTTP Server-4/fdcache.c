@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "httpserver.h"
+#include "fdcache.h"
+#include "lock.h"
+
+// inotify:
+// https://man7.org/linux/man-pages/man7/inotify.7.html
+
+#define FD_SHARDS  16 // power of two
+#define FD_BUCKETS 64 // per shard, power of two
+// anything that can make an open descriptor or its stat() out of date
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+TAILQ_HEAD(fileList, OpenFile);
+
+typedef struct Shard {
+    pthread_mutex_t mutex;
+    OpenFile *buckets[FD_BUCKETS];
+    struct fileList lru; // least recently used first
+    int entries;
+    int capacity; // files; 0 with fewer than FD_SHARDS in all
+    unsigned long version; // invalidations of paths in this shard
+} Shard;
+
+static Shard shards[FD_SHARDS];
+static int capacity; // over all shards; 0: cache off
+static bool watching;
+
+static struct {
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong stale; // misses that found an out-of-date file
+    atomic_ulong evictions;
+    atomic_ulong invalidations;
+} stats;
+
+static Shard *shard_of(uint32_t hash) {
+    return &shards[hash & (FD_SHARDS - 1)];
+}
+
+static OpenFile **bucket(Shard *s, uint32_t hash) {
+    return &s->buckets[(hash / FD_SHARDS) & (FD_BUCKETS - 1)];
+}
+
+static OpenFile *find(Shard *s, uint32_t hash, const char *path) {
+    for (OpenFile *f = *bucket(s, hash); f != NULL; f = f->next) {
+        if (strcmp(f->path, path) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Take f out of the shard; the shard's reference is the caller's to drop.
+static void unlink_file(Shard *s, OpenFile *f) {
+    OpenFile **p = bucket(s, f->hash);
+    while (*p != f) {
+        p = &(*p)->next;
+    }
+    *p = f->next;
+    TAILQ_REMOVE(&s->lru, f, lru);
+    s->entries--;
+}
+
+// Drop every file (the watch lost events).
+static void clear(void) {
+    for (int i = 0; i < FD_SHARDS; i++) {
+        Shard *s = &shards[i];
+        OpenFile *f;
+        pthread_mutex_lock(&s->mutex);
+        struct fileList dropped = TAILQ_HEAD_INITIALIZER(dropped);
+        while ((f = TAILQ_FIRST(&s->lru)) != NULL) {
+            unlink_file(s, f);
+            TAILQ_INSERT_TAIL(&dropped, f, lru);
+        }
+        s->version++;
+        pthread_mutex_unlock(&s->mutex);
+        while ((f = TAILQ_FIRST(&dropped)) != NULL) {
+            TAILQ_REMOVE(&dropped, f, lru);
+            fdcache_release(f);
+        }
+    }
+}
+
+static void *watch_thread(void *arg) {
+    int fd = *(int *) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            continue; // EINTR; nothing else is expected from an inotify fd
+        }
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                clear();
+            } else if (ev->len > 0 && !is_temp_path(ev->name)) {
+                // a staged body's own events are not changes to any served file;
+                // its rename shows up again as IN_MOVED_TO for the target
+                fdcache_invalidate(ev->name);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+void fdcache_init(int files, bool watch) {
+    // split exactly, so that no more than files are ever open
+    capacity = files;
+    for (int i = 0; i < FD_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        TAILQ_INIT(&shards[i].lru);
+        shards[i].capacity = files / FD_SHARDS + (i < files % FD_SHARDS);
+    }
+    if (capacity == 0 || !watch) {
+        return;
+    }
+
+    // paths have no '/' (see check_format()), so the working directory is all there is to watch
+    static int fd;
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, ".", WATCH_MASK) < 0) {
+        err(EXIT_FAILURE, "inotify");
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_thread, &fd) != 0) {
+        errx(EXIT_FAILURE, "pthread_create() failed");
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    watching = true;
+}
+
+bool fdcache_enabled(void) {
+    return capacity > 0;
+}
+
+bool fdcache_watching(void) {
+    return watching;
+}
+
+unsigned long fdcache_version(const char *path) {
+    if (capacity == 0) {
+        return 0;
+    }
+    Shard *s = shard_of(path_hash(path));
+    pthread_mutex_lock(&s->mutex);
+    unsigned long version = s->version;
+    pthread_mutex_unlock(&s->mutex);
+    return version;
+}
+
+static bool matches(const OpenFile *f, const struct stat *st) {
+    return f->st.st_dev == st->st_dev && f->st.st_ino == st->st_ino
+           && f->st.st_size == st->st_size && f->st.st_mtim.tv_sec == st->st_mtim.tv_sec
+           && f->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+OpenFile *fdcache_lookup(const char *path, const struct stat *st) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    uint32_t hash = path_hash(path);
+    Shard *s = shard_of(hash);
+
+    pthread_mutex_lock(&s->mutex);
+    OpenFile *f = find(s, hash, path);
+    if (f != NULL && (st == NULL || matches(f, st))) {
+        TAILQ_REMOVE(&s->lru, f, lru);
+        TAILQ_INSERT_TAIL(&s->lru, f, lru);
+        atomic_fetch_add(&f->refs, 1);
+        pthread_mutex_unlock(&s->mutex);
+        atomic_fetch_add(&stats.hits, 1);
+        return f;
+    }
+    if (f != NULL) { // the file changed behind our back
+        unlink_file(s, f);
+        atomic_fetch_add(&stats.stale, 1);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    atomic_fetch_add(&stats.misses, 1);
+    if (f != NULL) {
+        fdcache_release(f);
+    }
+    return NULL;
+}
+
+OpenFile *fdcache_insert(const char *path, int fd, const struct stat *st, unsigned long version) {
+    OpenFile *f = calloc(1, sizeof(OpenFile));
+    if (f == NULL) {
+        return NULL;
+    }
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    f->hash = path_hash(f->path);
+    f->fd = fd;
+    f->st = *st;
+    atomic_init(&f->refs, 2); // the shard's and the caller's
+
+    Shard *s = shard_of(f->hash);
+    OpenFile *dropped = NULL; // chained through next, released after unlocking
+
+    pthread_mutex_lock(&s->mutex);
+    if (s->version != version || s->capacity == 0) {
+        pthread_mutex_unlock(&s->mutex);
+        free(f);
+        return NULL;
+    }
+    OpenFile *old = find(s, f->hash, f->path);
+    if (old != NULL) {
+        unlink_file(s, old);
+        old->next = dropped;
+        dropped = old;
+    }
+    while (s->entries >= s->capacity) {
+        OpenFile *victim = TAILQ_FIRST(&s->lru);
+        unlink_file(s, victim);
+        victim->next = dropped;
+        dropped = victim;
+        atomic_fetch_add(&stats.evictions, 1);
+    }
+    OpenFile **b = bucket(s, f->hash);
+    f->next = *b;
+    *b = f;
+    TAILQ_INSERT_TAIL(&s->lru, f, lru);
+    s->entries++;
+    pthread_mutex_unlock(&s->mutex);
+
+    while (dropped != NULL) {
+        OpenFile *next = dropped->next;
+        fdcache_release(dropped);
+        dropped = next;
+    }
+    return f;
+}
+
+void fdcache_release(OpenFile *f) {
+    if (atomic_fetch_sub(&f->refs, 1) == 1) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+void fdcache_invalidate(const char *path) {
+    if (capacity == 0) {
+        return;
+    }
+    uint32_t hash = path_hash(path);
+    Shard *s = shard_of(hash);
+
+    pthread_mutex_lock(&s->mutex);
+    s->version++;
+    OpenFile *f = find(s, hash, path);
+    if (f != NULL) {
+        unlink_file(s, f);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    if (f != NULL) {
+        atomic_fetch_add(&stats.invalidations, 1);
+        fdcache_release(f);
+    }
+}
+
+void fdcache_report(void) {
+    if (capacity == 0) {
+        return;
+    }
+    int entries = 0;
+    for (int i = 0; i < FD_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        entries += shards[i].entries;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+    warnx("open files: entries=%d hits=%lu misses=%lu stale=%lu evictions=%lu invalidations=%lu",
+        entries, atomic_load(&stats.hits), atomic_load(&stats.misses), atomic_load(&stats.stale),
+        atomic_load(&stats.evictions), atomic_load(&stats.invalidations));
+}
@@ -0,0 +1,57 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+// Open file descriptors of GET files that neither the content cache nor the
+// mappings (cache.h) take, keyed by path and sharded by its hash like the
+// content cache. Each shard is an LRU list bounded by its share of the number
+// of files (some shards get none when there are fewer files than shards). A hit
+// replaces open() + fstat() + close() with the stat() that checks it against
+// the file's device, inode, mtime and size; with -I an inotify watch on the
+// served directory drops changed files instead, and a hit costs no system call
+// at all. PUT (at its rename) and APPEND (at its open) drop the file outright.
+//
+// The descriptor is shared by every request sending the file, so it is only
+// ever read at explicit offsets (sendfile() with an offset, see io.h).
+
+typedef struct OpenFile {
+    char path[100];
+    uint32_t hash;
+    int fd; // O_RDONLY
+    struct stat st; // as of the open
+
+    atomic_int refs; // the shard's reference plus one per request sending it
+
+    // owned by the shard
+    TAILQ_ENTRY(OpenFile) lru;
+    struct OpenFile *next; // hash chain
+} OpenFile;
+
+// files: most open files over all shards; 0 turns the cache off. watch:
+// trust inotify instead of a stat() per hit.
+void fdcache_init(int files, bool watch);
+bool fdcache_enabled(void);
+bool fdcache_watching(void);
+
+// Changes seen so far to paths in path's shard; read it before the stat()/open()
+// whose result goes to fdcache_insert(), so a change in between keeps the file out.
+unsigned long fdcache_version(const char *path);
+// A referenced file for path if it still matches st (NULL: with -I, unchecked),
+// else NULL.
+OpenFile *fdcache_lookup(const char *path, const struct stat *st);
+// Take over fd (st describes it) and publish it; a referenced file, or NULL if
+// the file changed since version (or its shard holds no files, or memory ran
+// out), in which case fd is still the caller's.
+OpenFile *fdcache_insert(const char *path, int fd, const struct stat *st, unsigned long version);
+void fdcache_release(OpenFile *f);
+// The file changed (PUT/APPEND, or inotify): forget it.
+void fdcache_invalidate(const char *path);
+
+// Print the hit/miss/eviction counters to stderr.
+void fdcache_report(void);
+
+#endif
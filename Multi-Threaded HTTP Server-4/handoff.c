@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+// SCM_RIGHTS:
+// https://man7.org/linux/man-pages/man7/unix.7.html
+// socket activation:
+// https://www.freedesktop.org/software/systemd/man/sd_listen_fds.html
+
+#define FIRST_INHERITED 3 // SD_LISTEN_FDS_START
+#define MAX_FDS         253 // SCM_MAX_FD
+#define ACK_SECONDS     30 // how long a successor may take to start its workers
+
+int handoff_inherited(int *fds, int max) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    if (pid == NULL || count == NULL || strtol(pid, NULL, 10) != getpid()) {
+        return 0;
+    }
+    int n = strtol(count, NULL, 10);
+    for (int i = 0; i < n && i < max; i++) {
+        fds[i] = FIRST_INHERITED + i;
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    return n > 0 ? n : 0;
+}
+
+static socklen_t unix_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errx(EXIT_FAILURE, "handoff socket path too long: %s", path);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return sizeof(*addr);
+}
+
+int handoff_receive(const char *path, int *fds, int max, int *conn) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        err(EXIT_FAILURE, "handoff socket");
+    }
+    if (connect(fd, (struct sockaddr *) &addr, len) < 0) {
+        close(fd); // nobody to take over from (a stale socket file is refused)
+        return 0;
+    }
+
+    int n = 0;
+    struct iovec iov = { .iov_base = &n, .iov_len = sizeof(n) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(n) || n <= 0) {
+        errx(EXIT_FAILURE, "handoff from %s failed", path);
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+        errx(EXIT_FAILURE, "handoff from %s: no sockets received", path);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (n < max ? n : max));
+    *conn = fd;
+    return n;
+}
+
+void handoff_done(int conn) {
+    char ack = 1;
+    if (write(conn, &ack, 1) != 1) {
+        warn("handoff");
+    }
+    close(conn);
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        err(EXIT_FAILURE, "handoff socket");
+    }
+    // the old server's socket file, if any; it keeps its (now nameless) socket
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, len) < 0 || listen(fd, 1) < 0) {
+        err(EXIT_FAILURE, "handoff socket %s", path);
+    }
+    return fd;
+}
+
+int handoff_send(int listenfd, const int *fds, int n) {
+    int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (n > MAX_FDS) {
+        warnx("handoff: too many listening sockets (%d)", n);
+        close(fd);
+        return 0;
+    }
+    struct timeval tv = { .tv_sec = ACK_SECONDS };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct iovec iov = { .iov_base = &n, .iov_len = sizeof(n) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * n),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    char ack = 0;
+    bool done = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(n) && read(fd, &ack, 1) == 1;
+    close(fd);
+    return done ? 1 : 0;
+}
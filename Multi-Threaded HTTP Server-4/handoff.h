@@ -0,0 +1,30 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+
+// Hot restart. A running server started with -U path hands its listening
+// sockets to a successor started with the same -U over that Unix socket
+// (SCM_RIGHTS). Both accept from the same sockets until the successor's
+// workers run; then the old server drains (see draining()). The sockets never
+// close in between, so no connection is refused or loses its place in the backlog.
+
+// Listening sockets the parent passed down as systemd socket activation does
+// (LISTEN_PID, LISTEN_FDS, fds from 3 on): their number, and at most max of
+// them in fds; 0 if there are none.
+int handoff_inherited(int *fds, int max);
+
+// Ask the server listening at path for its sockets: their number, and at most
+// max of them in fds; 0 if no server is there. *conn stays open for handoff_done().
+int handoff_receive(const char *path, int *fds, int max, int *conn);
+// The successor is serving: let the old server drain.
+void handoff_done(int conn);
+
+// Listen for a successor at path, replacing whatever socket file is there.
+int handoff_listen(const char *path);
+// Wait for a successor to connect, send it the n sockets in fds and wait for
+// its handoff_done(). 1 once it has them, 0 if it went away (or took too
+// long) first, -1 if accept() failed (errno says why).
+int handoff_send(int listenfd, const int *fds, int n);
+
+#endif
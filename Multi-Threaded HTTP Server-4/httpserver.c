@@ -1,13 +1,20 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -16,66 +23,123 @@
 #include <ctype.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
-
+#include <stdatomic.h>
+
+#include "httpserver.h"
+#include "cache.h"
+#include "event.h"
+#include "fdcache.h"
+#include "handoff.h"
+#include "io.h"
+#include "lock.h"
+#include "log.h"
+#include "metrics.h"
+#include "parser.h"
 #include "queue.h"
+#include "uring.h"
 
-#define OPTIONS              "t:l:"
-#define VERSION              "HTTP/1.1"
-#define BUF_SIZE             4096
-#define VALUE_SIZE           2048
+#define OPTIONS              "t:l:q:o:e:k:d:c:m:F:If:b:L:r:R:M:s:a:Pg:U:"
 #define DEFAULT_THREAD_COUNT 4
-
-static FILE *logfile;
-#define LOG(...) fprintf(logfile, __VA_ARGS__);
+#define RETIRE_SECONDS       10 // -t min:max: a worker idle this long exits
+#define SCALE_INTERVAL_MS    10 // how often the pool controller looks at the queue
+#define SCALE_WAIT_MS        5 // a queue wait this long asks for another worker
+#define DEFAULT_QUEUE_SIZE   1024
+#define RETRY_AFTER          1 // seconds, sent with 503 when the queue is full
+#define DEFAULT_IDLE_TIMEOUT 5 // seconds
+#define DEFAULT_CACHE_MB     64
+#define DEFAULT_FLUSH_MS     10
+#define DEFAULT_LOG_BATCH    65536 // bytes
+#define DEFAULT_DRAIN_SECONDS 10 // -g: how long SIGTERM waits for connections to finish
+#define HANDOFF_RETRY_SECONDS 1 // -U: wait before accepting again when out of descriptors
+
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+durability sync_mode = SYNC_NONE;
+
+// thread_pool slot states
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_EXITED };
 
 typedef struct {
     int thread_id;
     pthread_t *thread;
+    int listenfd; // what the worker accepts from, unless the acceptor feeds it
+    int cpu; // pinned to it with -P, else -1
+    atomic_int state; // SLOT_*; an exited worker is joined before its slot is reused
 } reqThread;
 
 static reqThread **thread_pool;
 
-typedef enum key {
-    GET,
-    PUT,
-    APPEND,
-    REQUEST_ID,
-    HOST,
-    USER_AGENT,
-    ACCEPT,
-    CONTENT_LENGTH,
-    CONTENT_TYPE,
-    EXPECT,
-    TOTAL,
-} key;
-
-char *string[TOTAL] = {
-    [GET] = "GET",
-    [PUT] = "PUT",
-    [APPEND] = "APPEND",
-    [REQUEST_ID] = "Request-Id:", //id
-    [HOST] = "Host:",
-    [USER_AGENT] = "User-Agent:",
-    [ACCEPT] = "Accept:",
-    [CONTENT_LENGTH] = "Content-Length:",
-    [CONTENT_TYPE] = "Content-Type:",
-    [EXPECT] = "Expect:",
-};
-
-typedef struct Request {
-    int socket;
-
-    int method; // Method
-    char path[100]; // URI
-    char version[100]; // Version
-
-    unsigned long int cnt_len; // Content-Length
-    int req_id; //Request-Id
-
-    char msg_bdy[VALUE_SIZE]; // Message-Body
-    int read_len;
-} Request;
+// Worker count. With -t min:max the threads engine's pool grows from min
+// while connections wait, and workers idle for RETIRE_SECONDS shrink it back.
+static struct {
+    int min;
+    int max; // thread_pool has a slot for each
+    atomic_int live;
+    _Atomic uint64_t max_wait; // longest queue wait since the controller last looked, ns
+    atomic_ulong spawned;
+    atomic_ulong retired;
+} pool;
+
+// What the acceptor does when the connection queue is full
+typedef enum overflow {
+    BLOCK, // stop calling accept() until a worker frees a slot
+    REJECT, // answer the new connection with 503 and close it
+    SHED, // answer the oldest queued connection with 503 and queue the new one
+} overflow;
+
+// Admission counters, dumped on SIGUSR1
+static struct {
+    atomic_ulong queued;
+    atomic_ulong rejected;
+    atomic_ulong shed;
+} admission;
+
+static volatile sig_atomic_t dump_stats;
+
+// Graceful shutdown (see draining()). SIGTERM, or a successor taking over the
+// listeners, raises the flag and the eventfd; main waits for the workers until
+// the deadline (-g).
+static struct {
+    atomic_bool on;
+    int fd; // eventfd
+    int *listenfds; // what a successor gets (-U)
+    int nlisten;
+    atomic_int accepting; // workers accepting for themselves that have not stopped
+    int seconds;
+} drain = { .fd = -1, .seconds = DEFAULT_DRAIN_SECONDS };
+
+// Async-signal-safe.
+static void start_drain(void) {
+    atomic_store(&drain.on, true);
+    uint64_t one = 1;
+    write(drain.fd, &one, sizeof(one));
+}
+
+bool draining(void) {
+    return atomic_load_explicit(&drain.on, memory_order_relaxed);
+}
+
+int drain_fd(void) {
+    return drain.fd;
+}
+
+void stopped_accepting(void) {
+    atomic_fetch_sub(&drain.accepting, 1);
+}
+
+// How the threads engine's workers share the queued connections
+typedef enum scheduler {
+    SHARED, // one queue every worker takes from
+    STEAL, // a queue per worker, filled round-robin; idle workers steal from busy ones
+} scheduler;
+
+// How connections are served
+typedef enum engine {
+    THREADS, // acceptor + queue, one blocking worker per connection
+    EPOLL, // every worker runs its own epoll loop (see event.c)
+    URING, // every worker runs its own io_uring (see uring.c)
+} engine;
 
 // Status-Phrase
 const char *Phrase(int code) {
@@ -87,13 +151,15 @@ const char *Phrase(int code) {
     case 404: return "Not Found";
     case 500: return "Internal Server Error";
     case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
     }
     return NULL;
 }
 
 int check_format(Request *req) {
     // Check for version
-    if (strncmp(req->version, VERSION, 8) != 0) {
+    if (req->version.len != strlen(VERSION)
+        || memcmp(req->version.ptr, VERSION, req->version.len) != 0) {
         return 0;
     }
     // Check for valid path format
@@ -115,56 +181,236 @@ int check_format(Request *req) {
     return 1;
 }
 
-void send_response(Request *req, int status) {
-    //fprintf(logfile, "%s,/%s,%d,%d\n", string[req->method], req->path, status, req->req_id);
-    LOG("%s,/%s,%d,%d\n", string[req->method], req->path, status, req->req_id);
-    fflush(logfile);
-
-    char response[VALUE_SIZE];
-    if (req->method == GET && status == 200) { // Content-Length: length of content from file
-        sprintf(response, "HTTP/1.1 %d %s\r\nContent-Length: %d\r\n\r\n", status, Phrase(status),
-            req->read_len);
-        write(req->socket, response, strlen(response));
-        return;
+size_t request_size(const Request *req) {
+    return req->hdr_len + (req->bdy_len < req->cnt_len ? req->bdy_len : req->cnt_len);
+}
+
+void discard_body(Request *req) {
+    if (req->cnt_len > req->bdy_len) {
+        req->conn_close = true;
     }
+}
 
-    else {
-        int cnt_len = strlen(Phrase(status)) + 1; // Content-Length: length of Message-Body
-        sprintf(response, "HTTP/1.1 %d %s\r\nContent-Length: %d\r\n\r\n%s\n", status,
-            Phrase(status), cnt_len, Phrase(status));
-        write(req->socket, response, strlen(response));
+void log_response(Request *req, int status) {
+    // the response tells the client not to send more, unless more (pipelined)
+    // requests are already here to be answered first
+    if (draining() && req->bdy_len <= req->cnt_len) {
+        req->conn_close = true;
+    }
+    metrics_response(req, status);
+    log_record(req, status);
+    unlock_request(req);
+}
+
+#define CLOSE_HEADER "Connection: close\r\n"
+
+// Every status-only reply, for every combination of the optional headers,
+// formatted once by replies_init(); the Message-Body is the Status-Phrase.
+static const int reply_codes[] = { 200, 201, 400, 403, 404, 500, 501, 503 };
+#define REPLY_CODES    (sizeof(reply_codes) / sizeof(reply_codes[0]))
+#define REPLY_VARIANTS 4 // REPLY_CLOSE | REPLY_RETRY
+static char reply_bytes[REPLY_CODES][REPLY_VARIANTS][128];
+static Slice replies[REPLY_CODES][REPLY_VARIANTS];
+
+void replies_init(void) {
+    for (size_t i = 0; i < REPLY_CODES; i++) {
+        const char *phrase = Phrase(reply_codes[i]);
+        for (unsigned h = 0; h < REPLY_VARIANTS; h++) {
+            char retry[32] = "";
+            if (h & REPLY_RETRY) {
+                snprintf(retry, sizeof(retry), "Retry-After: %d\r\n", RETRY_AFTER);
+            }
+            int len = snprintf(reply_bytes[i][h], sizeof(reply_bytes[i][h]),
+                "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n%s%s\r\n%s\n", reply_codes[i], phrase,
+                strlen(phrase) + 1, retry, h & REPLY_CLOSE ? CLOSE_HEADER : "", phrase);
+            replies[i][h] = (Slice) { reply_bytes[i][h], len };
+        }
+    }
+}
+
+Slice status_reply(int status, unsigned headers) {
+    size_t i = 0;
+    while (i < REPLY_CODES && reply_codes[i] != status) {
+        i++;
+    }
+    return i < REPLY_CODES ? replies[i][headers] : status_reply(500, headers);
+}
+
+Slice status_response(Request *req, int status) {
+    log_response(req, status);
+    return status_reply(status, req->conn_close ? REPLY_CLOSE : 0);
+}
+
+size_t ok_header(off_t len, char *out) {
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: ";
+    memcpy(out, head, sizeof(head) - 1);
+    size_t n = sizeof(head) - 1;
+    char digits[24];
+    int d = 0;
+    do {
+        digits[d++] = '0' + len % 10;
+        len /= 10;
+    } while (len > 0);
+    while (d > 0) {
+        out[n++] = digits[--d];
+    }
+    memcpy(out + n, "\r\n", 2);
+    return n + 2;
+}
+
+size_t get_response(Request *req, char *out) {
+    log_response(req, 200);
+    size_t n = ok_header(req->read_len, out);
+    if (req->conn_close) {
+        memcpy(out + n, CLOSE_HEADER, strlen(CLOSE_HEADER));
+        n += strlen(CLOSE_HEADER);
+    }
+    memcpy(out + n, "\r\n", 2);
+    return n + 2;
+}
+
+void send_response(Request *req, int status) {
+    if (req->method == GET && status == 200) {
+        char head[HEADER_SIZE];
+        size_t len = get_response(req, head);
+        // MSG_MORE: let the header share a segment with the body that follows
+        // instead of waiting out Nagle + delayed ACK on keep-alive connections
+        send(req->socket, head, len, req->read_len > 0 ? MSG_MORE : 0);
         return;
     }
-    return;
+    Slice reply = status_response(req, status);
+    send(req->socket, reply.ptr, reply.len, 0);
 }
 
-void process_get(Request *req) {
-    int fd = 0, sz = 0, total_read = 0;
+static int open_regular(Request *req, int *status, struct stat *st) {
+    int fd = 0;
     if ((fd = open(req->path, O_RDONLY, 0)) < 0) {
-        if (errno == 2) {
-            send_response(req, 404);
-        } else {
-            send_response(req, 403);
+        *status = errno == 2 ? 404 : 403;
+        return -1;
+    }
+
+    if (fstat(fd, st) < 0) {
+        *status = 500;
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        *status = 403;
+        close(fd);
+        return -1;
+    }
+
+    req->read_len = st->st_size;
+    *status = 200;
+    return fd;
+}
+
+int open_get(Request *req, int *status) {
+    struct stat st;
+    return open_regular(req, status, &st);
+}
+
+static CacheEntry *lookup_or_open(Request *req, int *fd, int *status) {
+    struct stat st;
+    unsigned long version = fdcache_version(req->path);
+    // with -I an open file is as inotify left it, no stat() needed
+    OpenFile *f = fdcache_watching() ? fdcache_lookup(req->path, NULL) : NULL;
+    if (f == NULL && (cache_enabled() || fdcache_enabled()) && stat(req->path, &st) == 0
+        && S_ISREG(st.st_mode)) {
+        CacheEntry *e = cache_lookup(req->path, &st);
+        if (e == NULL) {
+            e = cache_map_lookup(&st);
+        }
+        if (e != NULL) {
+            req->read_len = e->size;
+            *fd = -1;
+            *status = 200;
+            return e;
+        }
+        if (!fdcache_watching()) {
+            f = fdcache_lookup(req->path, &st);
         }
-        return;
+    }
+    if (f != NULL) {
+        req->open_file = f;
+        req->read_len = f->st.st_size;
+        *fd = f->fd;
+        *status = 200;
+        return NULL;
     }
 
-    int buf_sz = 300;
-    char *chr = (char *) malloc(buf_sz * sizeof(char));
-    while ((sz = read(fd, chr + total_read, 200)) > 0) {
-        total_read += sz;
-        if (total_read + 200 > buf_sz) {
-            buf_sz += 200;
+    *fd = open_regular(req, status, &st);
+    if (*fd < 0) {
+        return NULL;
+    }
+    if (!cache_admits(st.st_size) && !cache_map_admits(st.st_size)) {
+        req->open_file = fdcache_enabled() ? fdcache_insert(req->path, *fd, &st, version) : NULL;
+        return NULL;
+    }
+    CacheEntry *e = cache_admits(st.st_size) ? cache_fill(req->path, *fd, &st) : cache_map(*fd, &st);
+    if (e != NULL) {
+        close(*fd);
+        *fd = -1;
+    }
+    return e;
+}
+
+CacheEntry *open_cached(Request *req, int *fd, int *status) {
+    if (metrics_request(req)) {
+        CacheEntry *e = metrics_reply();
+        if (e != NULL) {
+            req->read_len = e->size;
+            *fd = -1;
+            *status = 200;
+            return e;
+        }
+    }
+    uint64_t begin = metrics_now();
+    CacheEntry *e = lookup_or_open(req, fd, status);
+    req->disk_ns += metrics_now() - begin;
+    return e;
+}
+
+void close_get(Request *req, int fd) {
+    if (req->open_file != NULL) {
+        fdcache_release(req->open_file);
+        req->open_file = NULL;
+    } else {
+        close(fd);
+    }
+}
+
+// GET Method:
+// Content-Length comes from fstat(). Small hot files are answered from the
+// content cache with one writev(), and with -m bigger ones from a shared
+// mapping the same way; the rest is streamed from the file straight to the
+// socket (see io.c), so memory per request stays constant.
+void process_get(Request *req) {
+    int status = 0;
+    int fd = -1;
+    lock_request(req); // until the header is built: fstat() then sees no half-done APPEND
+    CacheEntry *e = open_cached(req, &fd, &status);
+    if (e != NULL) {
+        size_t off = 0;
+        log_response(req, 200);
+        if (cache_send(req->socket, e, req->conn_close, &off) < 0) {
+            req->conn_close = true; // part of the response may be out
         }
-        chr = (char *) realloc(chr, buf_sz * sizeof(char));
+        cache_release(e);
+        return;
+    }
+    if (fd < 0) {
+        send_response(req, status);
+        return;
     }
 
-    req->read_len = total_read;
     send_response(req, 200);
 
-    write(req->socket, chr, total_read);
-    close(fd);
-    free(chr);
+    // a short body leaves the client waiting for the rest of Content-Length
+    if (send_file(req->socket, fd, req->read_len) != req->read_len) {
+        req->conn_close = true;
+    }
+    close_get(req, fd);
 }
 
 // PUT Method:
@@ -181,201 +427,234 @@ void process_get(Request *req) {
 // 403: Forbidden 404: Not Found
 // errno 2 no such file or directory
 
-void process_put_append(Request *req) {
-    int fd = 0;
-    int status = 0;
-    if (access(req->path, F_OK) == 0)
-        status = 200; // truncate code OK
-
-    else
-        status = 201; // create code CREATED
+void make_temp_path(Request *req) {
+    static atomic_uint seq;
+    snprintf(req->tmp_path, sizeof(req->tmp_path), ".%s.%d.%u.tmp", req->path, (int) getpid(),
+        atomic_fetch_add(&seq, 1));
+}
 
-    if (req->method == PUT) {
-        fd = open(req->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (fd < 0) {
-            send_response(req, 500);
-            return;
-        }
+bool is_temp_path(const char *name) {
+    char pid[16];
+    int n = snprintf(pid, sizeof(pid), ".%d.", (int) getpid());
+    size_t len = strlen(name);
+    if (name[0] != '.' || len < 4 || strcmp(name + len - 4, ".tmp") != 0) {
+        return false;
+    }
+    // back over the sequence number to the ".pid." in front of it
+    const char *end = name + len - 4;
+    const char *seq = end;
+    while (seq > name && isdigit((unsigned char) seq[-1])) {
+        seq--;
     }
+    return seq < end && seq - name >= n + 2 && memcmp(seq - n, pid, n) == 0;
+}
+
+bool body_staged(const Request *req) {
+    return req->method == PUT || (req->method == APPEND && req->bdy_len < req->cnt_len);
+}
 
-    if (req->method == APPEND) {
-        fd = open(req->path, O_WRONLY | O_APPEND, 0);
+static int open_target(Request *req, int *status) {
+    int fd = 0;
+    if (body_staged(req)) {
+        // The body goes to a private file in the same directory. For PUT,
+        // commit_temp() renames it over the target, so readers see the old file
+        // or the new one, never a truncated or half-written one. For APPEND it
+        // copies it onto the end, so a slow client never holds the lock.
+        if (req->method == APPEND && access(req->path, W_OK) < 0) {
+            // checked again at commit_temp(); this spares receiving the body
+            *status = errno == 2 ? 404 : 0;
+            return -1;
+        }
+        make_temp_path(req);
+        fd = open(req->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
         if (fd < 0) {
-            if (errno == 2) { // Not Found
-                send_response(req, 404);
-            }
-            /*else { // Forbidden
-                send_response(req, 403);
-            }*/
-            return;
+            req->tmp_path[0] = '\0';
+            *status = 500;
+            return -1;
         }
+        *status = 0; // decided at commit_temp()
+        return fd;
     }
 
-    write(fd, req->msg_bdy, req->cnt_len);
-    close(fd);
-
-    if (req->cnt_len > strlen(req->msg_bdy)) {
-        return;
-    }
-    send_response(req, status);
-    /*
-    if (req->cnt_len < strlen(req->msg_bdy)) {
-    	//printf("send bad response\n");
-        send_response(req, 400);
-    }*/
-}
-
-int parse_line(char *line, Request *req) {
-    int key_type = -1;
-    int count = 0;
-    char value[10][VALUE_SIZE];
-
-    // Extract method and key
-    char *tok = NULL;
-    tok = strtok(line, " ");
-    while (tok != NULL) {
-        if (count == 0) {
-            for (int i = 0; i < TOTAL; i++) {
-                if (strstr(tok, string[i])) {
-                    key_type = i;
-                    break;
-                }
-            }
-        } else {
-            strncpy(value[count - 1], tok, VALUE_SIZE);
-        }
-        count += 1;
-        tok = strtok(NULL, " ");
+    // The rest of an APPEND came with the header: write it in place, under the
+    // lock. APPEND never creates the file, so opening it is the existence check.
+    fd = open(req->path, O_WRONLY | O_APPEND, 0);
+    if (fd < 0) {
+        // Not Found; anything else (Forbidden) gets no response
+        *status = errno == 2 ? 404 : 0;
+        return -1;
     }
+    *status = 200;
+    cache_invalidate(req->path);
+    fdcache_invalidate(req->path);
+    return fd;
+}
 
-    // Unexpected line
-    //if (key_type == -1) {
-    //fprintf(stderr, "Unknown params, ignoring line\n");
-    //errx(EXIT_FAILURE, "Unknown params, ignoring line\n");
-    //return -1;
-    //}
+int open_put_append(Request *req, int *status) {
+    uint64_t begin = metrics_now();
+    int fd = open_target(req, status);
+    req->disk_ns += metrics_now() - begin;
+    return fd;
+}
 
-    switch (key_type) {
-    case GET: {
-        req->method = GET;
-        strcpy(req->path, value[0]);
-        strcpy(req->version, value[1]);
-        break;
+static int sync_fd(int fd) {
+    switch (sync_mode) {
+    case SYNC_DATA: return fdatasync(fd);
+    case SYNC_FULL: return fsync(fd);
+    default: return 0;
     }
+}
 
-    case PUT: {
-        req->method = PUT;
-        strcpy(req->path, value[0]);
-        strcpy(req->version, value[1]);
-        break;
+int sync_file(Request *req, int fd) {
+    if (req->method == APPEND && req->tmp_path[0] != '\0') {
+        return 0; // commit_temp() syncs the target after the copy instead
     }
+    uint64_t begin = metrics_now();
+    int rc = sync_fd(fd);
+    req->disk_ns += metrics_now() - begin;
+    return rc;
+}
 
-    case APPEND: {
-        req->method = APPEND;
-        strcpy(req->path, value[0]);
-        strcpy(req->version, value[1]);
-        break;
+static int rename_temp(Request *req) {
+    int status = access(req->path, F_OK) == 0 ? 200 : 201;
+    if (rename(req->tmp_path, req->path) < 0) {
+        remove_temp(req);
+        return 500;
     }
-
-    case REQUEST_ID: {
-        req->req_id = atoi(value[0]);
-        break;
+    req->tmp_path[0] = '\0';
+    cache_invalidate(req->path);
+    fdcache_invalidate(req->path);
+    if (sync_mode == SYNC_FULL) {
+        // the new name lives in the directory, which has to reach the disk too
+        int dir = open(".", O_RDONLY | O_DIRECTORY);
+        if (dir < 0 || fsync(dir) < 0) {
+            status = 500;
+        }
+        if (dir >= 0) {
+            close(dir);
+        }
     }
+    return status;
+}
 
-    case HOST: {
-        break;
+static int append_temp(Request *req) {
+    int out = open(req->path, O_WRONLY);
+    if (out < 0) {
+        // gone (or made read-only) since open_target() looked; the body is
+        // read by now, so this one gets an answer
+        int status = errno == 2 ? 404 : 403;
+        remove_temp(req);
+        return status;
     }
-
-    case USER_AGENT: {
-        break;
+    int status = 200;
+    int in = open(req->tmp_path, O_RDONLY);
+    off_t end = lseek(out, 0, SEEK_END);
+    if (in < 0 || end < 0 || copy_range(out, end, in, req->cnt_len) != (ssize_t) req->cnt_len
+        || sync_fd(out) < 0) {
+        status = 500;
     }
-
-    case ACCEPT: {
-        break;
+    cache_invalidate(req->path);
+    fdcache_invalidate(req->path);
+    if (in >= 0) {
+        close(in);
     }
+    close(out);
+    remove_temp(req);
+    return status;
+}
 
-    case CONTENT_LENGTH: {
-        unsigned long int length = atoi(value[0]);
-        req->cnt_len = length;
-        break;
-    }
+int commit_temp(Request *req) {
+    uint64_t begin = metrics_now();
+    int status = req->method == PUT ? rename_temp(req) : append_temp(req);
+    req->disk_ns += metrics_now() - begin;
+    return status;
+}
 
-    case CONTENT_TYPE: {
-        break;
+void remove_temp(Request *req) {
+    if (req->tmp_path[0] != '\0') {
+        unlink(req->tmp_path);
+        req->tmp_path[0] = '\0';
     }
+}
 
-    case EXPECT: {
-        break;
+// A staged body (body_staged()) is streamed into a temp file without holding
+// the path's lock, which is only taken for commit_temp(). An APPEND whose body
+// came with the header writes it in place, holding the lock (exclusively) from
+// open to reply.
+void process_put_append(Request *req) {
+    int status = 0;
+    bool staged = body_staged(req);
+    if (!staged) {
+        lock_request(req);
+    }
+    int fd = open_put_append(req, &status);
+    if (fd < 0) {
+        discard_body(req);
+        if (status != 0) {
+            send_response(req, status);
+        }
+        unlock_request(req);
+        return;
     }
 
-    default: {
-        //fprintf(stderr, "Unknown param type: %i\n", key_type);
-        errx(EXIT_FAILURE, "Unknown param type: %i\n", key_type);
-        break;
+    // Body bytes already buffered with the header go first, the rest is
+    // streamed from the socket until Content-Length bytes have been stored.
+    size_t buffered = req->bdy_len < req->cnt_len ? req->bdy_len : req->cnt_len;
+    if (write_all(fd, req->msg_bdy, buffered) < 0) {
+        close(fd);
+        remove_temp(req);
+        discard_body(req);
+        send_response(req, 500);
+        return;
     }
+    ssize_t streamed = recv_file(fd, req->socket, req->cnt_len - buffered);
+    if (streamed < 0 || buffered + (size_t) streamed < req->cnt_len) {
+        close(fd);
+        remove_temp(req);
+        unlock_request(req);
+        req->conn_close = true; // client went away mid-body
+        return;
     }
 
-    return 1;
-}
-
-int extract_line(char *buffer, Request *req) {
-    const char *delim = "\r\n\r\n";
-    char *msg;
-    msg = strstr(buffer, delim);
-
-    if (msg != NULL) {
-        msg[0] = '\0';
-        msg[1] = '\0';
-        msg[2] = '\0';
-        msg[3] = '\0';
-        strncpy(req->msg_bdy, msg + strlen(delim), VALUE_SIZE);
+    if (sync_file(req, fd) < 0) {
+        status = 500;
     }
-    //printf("message line is-%s-real length is %lu\n",
-    //req->msg_bdy, strlen(req->msg_bdy));
-
-    char *line = strtok(buffer, "\r\n");
-    while (line != NULL) {
-        // manually set index
-        buffer += strlen(line) + strlen("\r\n");
-        if (parse_line(line, req) < 0) {
-            return -1;
+    close(fd);
+    if (staged) {
+        if (status == 500) {
+            remove_temp(req);
+        } else {
+            lock_request(req);
+            status = commit_temp(req);
         }
-        line = strtok(buffer, "\r\n"); // get next line
     }
-
-    return 1;
+    send_response(req, status);
 }
 
-void process_request(int connfd, char *buffer) {
-    Request req = { 0 };
-    req.req_id = 0;
-    req.socket = connfd;
-
-    int status = extract_line(buffer, &req);
-    if (status < 0) {
-        send_response(&req, 400);
-        return;
+void process_request(Request *req) {
+    if (req->method != PUT && req->method != APPEND) {
+        discard_body(req);
     }
 
     // Check request fields satisfy requirements
-    if (!check_format(&req)) {
-        send_response(&req, 400);
+    if (!check_format(req)) {
+        send_response(req, 400);
         return;
     }
 
     // Check commands
-    if (req.method == PUT || req.method == APPEND) {
-        process_put_append(&req);
+    if (req->method == PUT || req->method == APPEND) {
+        process_put_append(req);
         return;
     }
 
-    else if (req.method == GET) {
-        process_get(&req);
+    else if (req->method == GET) {
+        process_get(req);
         return;
     }
 
     else {
-        send_response(&req, 501);
+        send_response(req, 501);
         return;
     }
 
@@ -395,12 +674,18 @@ static size_t strtouint16(char number[]) {
 
 // Creates a socket for listening for connections.
 // Closes the program and prints an error message on error.
-static int create_listen_socket(uint16_t port) {
+// reuse_port: one of several sockets on port (-a); the kernel spreads new
+// connections over them by a hash of the client's address and port.
+static int create_listen_socket(uint16_t port, bool reuse_port) {
     struct sockaddr_in addr;
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listenfd < 0) {
         err(EXIT_FAILURE, "socket error");
     }
+    int one = 1;
+    if (reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        err(EXIT_FAILURE, "SO_REUSEPORT");
+    }
     memset(&addr, 0, sizeof addr);
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htons(INADDR_ANY);
@@ -408,92 +693,512 @@ static int create_listen_socket(uint16_t port) {
     if (bind(listenfd, (struct sockaddr *) &addr, sizeof addr) < 0) {
         err(EXIT_FAILURE, "bind error");
     }
-    if (listen(listenfd, 128) < 0) {
+    // Accepted sockets inherit it. Responses already leave in as few sends
+    // as they can (MSG_MORE, sendmsg); Nagle would only hold a pipelined
+    // response back until the client's delayed ACK for the previous one.
+    setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (listen(listenfd, LISTEN_BACKLOG) < 0) {
         err(EXIT_FAILURE, "listen error");
     }
     return listenfd;
 }
 
+// Wait until a listening socket is readable or the drain starts.
+static void wait_listener(int fd) {
+    struct pollfd fds[] = { { .fd = fd, .events = POLLIN }, { .fd = drain.fd, .events = POLLIN } };
+    poll(fds, 2, -1);
+}
+
+// The port a listening socket is bound to (0: not an IPv4 socket).
+static uint16_t socket_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0 || addr.sin_family != AF_INET) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+// Wait for the next request on a keep-alive connection: up to the idle timeout,
+// or DRAIN_IDLE_MS once the drain has started. Returns whether one is coming.
+static bool wait_request(int fd) {
+    struct pollfd fds[] = { { .fd = fd, .events = POLLIN }, { .fd = drain.fd, .events = POLLIN } };
+    for (;;) {
+        bool drain_now = draining();
+        int n = poll(fds, drain_now ? 1 : 2,
+            drain_now ? DRAIN_IDLE_MS : idle_timeout > 0 ? idle_timeout * 1000 : -1);
+        if ((n < 0 && errno == EINTR) || (n > 0 && fds[0].revents == 0)) {
+            continue; // the drain started
+        }
+        return n > 0;
+    }
+}
+
+// Serve requests on connfd until the client closes, asks to close, or idles
+// out. Requests may be pipelined: whatever follows a request in the buffer
+// is kept and parsed as the next one, so responses go out in order.
 static void handle_connection(int connfd) {
     char buf[BUF_SIZE];
-    memset(buf, 0, sizeof(buf));
+    size_t len = 0;
     ssize_t bytes_read;
+    bool served = false;
+    Parser parser;
+    Request req = { 0 };
+    req.socket = connfd;
+    parser_init(&parser);
 
-    // Read from connfd until EOF or error.
-    while ((bytes_read = read(connfd, buf, BUF_SIZE)) > 0) {
-        /*ssize_t bytes_written, bytes;
-        // Write to stdout.
-        bytes = 0;
-        do {
-            bytes_written = write(STDOUT_FILENO, buf + bytes, bytes_read - bytes);
-            if (bytes_written < 0) {
-                return;
+    if (idle_timeout > 0) {
+        struct timeval tv = { .tv_sec = idle_timeout };
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    for (;;) {
+        parseResult rc = metrics_parse(&parser, buf, len, &req);
+        if (rc == PARSE_AGAIN && len < BUF_SIZE) {
+            // The first request of a connection is always waited for.
+            if (len == 0 && served && !wait_request(connfd)) {
+                break;
             }
-            bytes += bytes_written;
-        } while (bytes_written > 0 && bytes < bytes_read);
-		
-        // Write to connfd.
-        bytes = 0;
-        do {
-            bytes_written = write(connfd, buf + bytes, bytes_read - bytes);
-            if (bytes_written < 0) {
-                return;
+            // Read until EOF, error or idle timeout; a header may arrive over several reads.
+            // A signal is no reason to drop the client.
+            bytes_read = read(connfd, buf + len, BUF_SIZE - len);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
             }
-            bytes += bytes_written;
-        } while (bytes_written > 0 && bytes < bytes_read);*/
+            if (bytes_read <= 0) {
+                break;
+            }
+            len += bytes_read;
+            continue;
+        }
 
         // process request
-        process_request(connfd, buf);
+        if (rc == PARSE_DONE) {
+            process_request(&req);
+        } else { // malformed, or header larger than the buffer: no way to find the next one
+            req.conn_close = true;
+            send_response(&req, 400);
+        }
+        metrics_done(&req);
+        if (req.conn_close) {
+            break;
+        }
+        served = true;
+
+        // keep what belongs to the next request
+        size_t used = request_size(&req);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+        memset(&req, 0, sizeof(req));
+        req.socket = connfd;
+        parser_init(&parser);
     }
     close(connfd);
 }
 
+// Fast reply for a connection we have no room for; nothing is read or logged.
+static void send_unavailable(int connfd) {
+    Slice reply = status_reply(503, REPLY_CLOSE | REPLY_RETRY);
+    write(connfd, reply.ptr, reply.len);
+    shutdown(connfd, SHUT_WR);
+    close(connfd);
+}
+
+// Hand a new connection to the workers according to the overflow policy.
+static void admit(int connfd, overflow policy) {
+    if (policy == BLOCK) {
+        enqueue(connfd);
+        atomic_fetch_add(&admission.queued, 1);
+        return;
+    }
+    if (tryEnqueue(connfd)) {
+        atomic_fetch_add(&admission.queued, 1);
+        return;
+    }
+    if (policy == SHED) {
+        int oldest;
+        if (tryDequeue(&oldest)) {
+            send_unavailable(oldest);
+            atomic_fetch_add(&admission.shed, 1);
+        }
+        if (tryEnqueue(connfd)) {
+            atomic_fetch_add(&admission.queued, 1);
+            return;
+        }
+    }
+    send_unavailable(connfd);
+    atomic_fetch_add(&admission.rejected, 1);
+}
+
+static bool pool_scales(void) {
+    return pool.min < pool.max;
+}
+
+// Leave the pool if it is above its minimum.
+static bool retire(void) {
+    int n = atomic_load(&pool.live);
+    while (n > pool.min) {
+        if (atomic_compare_exchange_weak(&pool.live, &n, n - 1)) {
+            atomic_fetch_add(&pool.retired, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void note_wait(uint64_t ns) {
+    uint64_t max = atomic_load_explicit(&pool.max_wait, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak(&pool.max_wait, &max, ns)) {
+    }
+}
+
 void *worker_thread(void *arg) {
+    reqThread *self = arg;
+    uint64_t idle_limit = pool_scales() ? (uint64_t) RETIRE_SECONDS * 1000000000 : 0;
+    queueJoin(self->thread_id);
+    for (;;) {
+        uint64_t waited;
+        int connfd = dequeueWithin(self->thread_id, idle_limit, &waited);
+        if (connfd == -1) { // idle for RETIRE_SECONDS, or drained
+            if (queueClosed() || retire()) {
+                queueLeave(self->thread_id);
+                atomic_store(&self->state, SLOT_EXITED);
+                return NULL;
+            }
+            continue;
+        }
+        metrics_time(T_QUEUE_WAIT, waited);
+        if (idle_limit != 0) {
+            note_wait(waited);
+        }
+        handle_connection(connfd);
+    }
+    return NULL;
+}
+
+static void start_worker(reqThread *t, void *(*worker)(void *), void *arg) {
+    if (atomic_load(&t->state) == SLOT_EXITED) {
+        pthread_join(*t->thread, NULL);
+    }
+    atomic_store(&t->state, SLOT_RUNNING);
+    if (pthread_create(t->thread, NULL, worker, arg) != 0) {
+        errx(EXIT_FAILURE, "pthread_create() failed");
+    }
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        int rc = pthread_setaffinity_np(*t->thread, sizeof(set), &set);
+        if (rc != 0) {
+            errno = rc;
+            warn("pinning worker %d to CPU %d", t->thread_id, t->cpu);
+        }
+    }
+}
+
+// -t min:max: every SCALE_INTERVAL_MS, start workers (into the lowest free
+// slots, so -s steal keeps using the same rings) for the connections waiting
+// while no worker is idle, or one more if a connection waited SCALE_WAIT_MS.
+static void *pool_controller(void *arg) {
     (void) arg;
+    struct timespec tick = { .tv_nsec = SCALE_INTERVAL_MS * 1000000L };
+    while (!draining()) {
+        nanosleep(&tick, NULL);
+        uint64_t waited = atomic_exchange(&pool.max_wait, 0);
+        size_t depth = queueDepth();
+        size_t want = depth > 0 && queueIdle() == 0             ? depth
+                      : waited >= SCALE_WAIT_MS * (uint64_t) 1000000 ? 1
+                                                                       : 0;
+        for (int i = 0; i < pool.max && want > 0 && atomic_load(&pool.live) < pool.max; i++) {
+            if (atomic_load(&thread_pool[i]->state) == SLOT_RUNNING) {
+                continue;
+            }
+            atomic_fetch_add(&pool.live, 1);
+            atomic_fetch_add(&pool.spawned, 1);
+            start_worker(thread_pool[i], worker_thread, thread_pool[i]);
+            want--;
+        }
+    }
+    return NULL;
+}
+
+// -a with the threads engine: accept from this worker's own listener and serve
+// the connection right here, with no acceptor thread or queue in between.
+void *accept_worker(void *arg) {
+    reqThread *self = arg;
+    int last = LISTEN_BACKLOG; // connections still taken once draining
     for (;;) {
-        int connfd = dequeue();
-        if (connfd != -1) {
+        int connfd = accept4(self->listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (connfd >= 0) {
             handle_connection(connfd);
+            if (draining() && --last == 0) {
+                break;
+            }
+        } else if (errno == EAGAIN) {
+            if (draining()) {
+                break;
+            }
+            wait_listener(self->listenfd);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            warn("accept error");
         }
     }
+    stopped_accepting();
     return NULL;
 }
 
 static void sigterm_handler(int sig) {
-    if (sig == SIGTERM) {
-        warnx("received SIGTERM");
-        fclose(logfile);
-        exit(EXIT_SUCCESS);
+    (void) sig;
+    start_drain(); // main does the rest
+}
+
+// -U: hand the listeners to the first successor that asks, then drain.
+static void *handoff_thread(void *arg) {
+    int listenfd = *(int *) arg;
+    int rc;
+    while ((rc = handoff_send(listenfd, drain.listenfds, drain.nlisten)) != 1) {
+        if (rc == 0 || errno == EINTR || errno == ECONNABORTED) {
+            continue; // that successor failed; wait for the next
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            sleep(HANDOFF_RETRY_SECONDS); // until some connection closes
+            continue;
+        }
+        warn("handoff: giving up");
+        close(listenfd);
+        return NULL;
+    }
+    warnx("listening sockets handed over");
+    start_drain();
+    close(listenfd);
+    return NULL;
+}
+
+static void sighup_handler(int sig) {
+    (void) sig;
+    log_rotate();
+}
+
+static void sigusr1_handler(int sig) {
+    (void) sig;
+    dump_stats = 1;
+}
+
+static void report_stats(void) {
+    if (!dump_stats) {
+        return;
+    }
+    dump_stats = 0;
+    warnx("queue: depth=%zu queued=%lu rejected=%lu shed=%lu steals=%zu", queueDepth(),
+        atomic_load(&admission.queued), atomic_load(&admission.rejected),
+        atomic_load(&admission.shed), queueSteals());
+    if (pool_scales()) {
+        warnx("pool: workers=%d min=%d max=%d spawned=%lu retired=%lu", atomic_load(&pool.live),
+            pool.min, pool.max, atomic_load(&pool.spawned), atomic_load(&pool.retired));
+    }
+    cache_report();
+    fdcache_report();
+}
+
+// The n-th (mod their count) CPU this process may run on.
+static int nth_cpu(const cpu_set_t *allowed, int n) {
+    n %= CPU_COUNT(allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && n-- == 0) {
+            return cpu;
+        }
     }
+    return 0;
 }
 
 static void usage(char *exec) {
-    fprintf(stderr, "usage: %s [-t threads] [-l logfile] <port>\n", exec);
+    fprintf(stderr,
+        "usage: %s [-t threads|min:max] [-l logfile] [-q queue-depth] [-o block|reject|shed] "
+        "[-s shared|steal] [-e threads|epoll|uring] [-k idle-timeout] [-d none|fdatasync|fsync] "
+        "[-c cache-MB] [-m map-MB] [-F open-files] [-I] [-L text|binary] [-f flush-ms] "
+        "[-b log-batch-bytes] [-r rotate-MB] [-R rotate-seconds] [-M metrics-path] "
+        "[-a listeners] [-P] [-g drain-seconds] [-U handoff-socket] <port>\n",
+        exec);
 }
 
 int main(int argc, char *argv[]) {
     int opt = 0;
-    int threads = DEFAULT_THREAD_COUNT;
-    logfile = stderr;
+    int threads = DEFAULT_THREAD_COUNT; // the most there can be
+    int min_threads = DEFAULT_THREAD_COUNT;
+    int queue_size = DEFAULT_QUEUE_SIZE;
+    long cache_mb = DEFAULT_CACHE_MB;
+    long map_mb = 0;
+    long open_files = 0;
+    bool watch = false;
+    overflow policy = BLOCK;
+    scheduler sched = SHARED;
+    int listeners = 0; // 0: one socket, shared
+    bool pin = false;
+    engine mode = THREADS;
+    LogConfig log = {
+        .format = LOG_TEXT,
+        .interval_ms = DEFAULT_FLUSH_MS,
+    };
+    long log_batch = DEFAULT_LOG_BATCH;
+    long rotate_mb = 0;
+    const char *metrics_name = NULL;
+    const char *upgrade_path = NULL;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 't':
-            threads = strtol(optarg, NULL, 10);
-            if (threads <= 0) {
+        {
+            char *end;
+            min_threads = strtol(optarg, &end, 10);
+            threads = *end == ':' ? strtol(end + 1, &end, 10) : min_threads;
+            if (*end != '\0' || min_threads <= 0 || threads < min_threads) {
                 errx(EXIT_FAILURE, "bad number of threads");
             }
+        }
             break;
         case 'l':
-            logfile = fopen(optarg, "w");
-            if (!logfile) {
-                errx(EXIT_FAILURE, "bad logfile");
+            log.path = optarg;
+            break;
+        case 'q':
+            queue_size = strtol(optarg, NULL, 10);
+            if (queue_size <= 0) {
+                errx(EXIT_FAILURE, "bad queue depth");
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "block") == 0) {
+                policy = BLOCK;
+            } else if (strcmp(optarg, "reject") == 0) {
+                policy = REJECT;
+            } else if (strcmp(optarg, "shed") == 0) {
+                policy = SHED;
+            } else {
+                errx(EXIT_FAILURE, "bad overflow policy: %s", optarg);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "shared") == 0) {
+                sched = SHARED;
+            } else if (strcmp(optarg, "steal") == 0) {
+                sched = STEAL;
+            } else {
+                errx(EXIT_FAILURE, "bad scheduler: %s", optarg);
+            }
+            break;
+        case 'a':
+            listeners = strtol(optarg, NULL, 10);
+            if (listeners <= 0) {
+                errx(EXIT_FAILURE, "bad number of listeners");
+            }
+            break;
+        case 'P':
+            pin = true;
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'g':
+            drain.seconds = strtol(optarg, NULL, 10);
+            if (drain.seconds < 0) {
+                errx(EXIT_FAILURE, "bad drain time");
+            }
+            break;
+        case 'k':
+            idle_timeout = strtol(optarg, NULL, 10);
+            if (idle_timeout < 0) {
+                errx(EXIT_FAILURE, "bad idle timeout");
+            }
+            break;
+        case 'c':
+            cache_mb = strtol(optarg, NULL, 10);
+            if (cache_mb < 0) {
+                errx(EXIT_FAILURE, "bad cache size");
+            }
+            break;
+        case 'm':
+            map_mb = strtol(optarg, NULL, 10);
+            if (map_mb < 0) {
+                errx(EXIT_FAILURE, "bad mapping cache size");
+            }
+            break;
+        case 'F':
+            open_files = strtol(optarg, NULL, 10);
+            if (open_files < 0 || open_files > INT_MAX) {
+                errx(EXIT_FAILURE, "bad open file cache size");
+            }
+            break;
+        case 'I':
+            watch = true;
+            break;
+        case 'M':
+            metrics_name = optarg[0] == '/' ? optarg + 1 : optarg;
+            break;
+        case 'L':
+            if (strcmp(optarg, "text") == 0) {
+                log.format = LOG_TEXT;
+            } else if (strcmp(optarg, "binary") == 0) {
+                log.format = LOG_BINARY;
+            } else {
+                errx(EXIT_FAILURE, "bad log format: %s", optarg);
+            }
+            break;
+        case 'f':
+            log.interval_ms = strtol(optarg, NULL, 10);
+            if (log.interval_ms < 0) {
+                errx(EXIT_FAILURE, "bad log flush interval");
+            }
+            break;
+        case 'b':
+            log_batch = strtol(optarg, NULL, 10);
+            if (log_batch <= 0) {
+                errx(EXIT_FAILURE, "bad log batch size");
+            }
+            break;
+        case 'r':
+            rotate_mb = strtol(optarg, NULL, 10);
+            if (rotate_mb <= 0) {
+                errx(EXIT_FAILURE, "bad log rotation size");
+            }
+            break;
+        case 'R':
+            log.rotate_seconds = strtol(optarg, NULL, 10);
+            if (log.rotate_seconds <= 0) {
+                errx(EXIT_FAILURE, "bad log rotation interval");
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "none") == 0) {
+                sync_mode = SYNC_NONE;
+            } else if (strcmp(optarg, "fdatasync") == 0) {
+                sync_mode = SYNC_DATA;
+            } else if (strcmp(optarg, "fsync") == 0) {
+                sync_mode = SYNC_FULL;
+            } else {
+                errx(EXIT_FAILURE, "bad durability mode: %s", optarg);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                mode = THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                mode = EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                mode = URING;
+            } else {
+                errx(EXIT_FAILURE, "bad engine: %s", optarg);
             }
             break;
         default: usage(argv[0]); return EXIT_FAILURE;
         }
     }
 
+    if (min_threads < threads && (mode != THREADS || listeners > 0)) {
+        errx(EXIT_FAILURE, "-t min:max needs -e threads without -a");
+    }
+    if (listeners > threads) {
+        errx(EXIT_FAILURE, "more listeners than threads: %d > %d", listeners, threads);
+    }
+
     if (optind >= argc) {
         warnx("wrong number of arguments");
         usage(argv[0]);
@@ -505,45 +1210,200 @@ int main(int argc, char *argv[]) {
         errx(EXIT_FAILURE, "bad port number: %s", argv[1]);
     }
 
+    drain.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (drain.fd < 0) {
+        err(EXIT_FAILURE, "eventfd");
+    }
+
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGTERM, sigterm_handler);
+    signal(SIGHUP, sighup_handler);
+
+    // No SA_RESTART: SIGUSR1 and SIGTERM interrupt main's poll() so the stats
+    // are printed, or the drain starts, right away. Workers start with them
+    // (and SIGHUP) blocked, so they reach main and leave the workers' waits alone.
+    struct sigaction sa = { 0 };
+    sa.sa_handler = sigusr1_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = sigterm_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t main_only;
+    sigemptyset(&main_only);
+    sigaddset(&main_only, SIGUSR1);
+    sigaddset(&main_only, SIGTERM);
+    sigaddset(&main_only, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &main_only, NULL);
 
     // Initialize queue
-    createQueue();
+    createQueue(queue_size, sched == STEAL ? threads : 1);
+    locks_init();
+    replies_init();
+    cache_init((size_t) cache_mb << 20);
+    cache_map_init((size_t) map_mb << 20);
+    fdcache_init(open_files, watch);
+    log.batch = log_batch;
+    log.rotate_bytes = (size_t) rotate_mb << 20;
+    log_open(&log);
+    metrics_init(metrics_name);
+
+    cpu_set_t allowed;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        err(EXIT_FAILURE, "sched_getaffinity");
+    }
+
+    // -a: listener j is shared by workers j, j + listeners, ...
+    int nlisten = listeners > 0 ? listeners : 1;
+    int *listenfds = malloc(sizeof(int) * nlisten);
+    // take over the sockets of a running server (-U), or the ones passed down
+    int handoff_conn = -1;
+    int taken = handoff_inherited(listenfds, nlisten);
+    if (taken == 0 && upgrade_path != NULL) {
+        taken = handoff_receive(upgrade_path, listenfds, nlisten, &handoff_conn);
+    }
+    if (taken != 0 && taken != nlisten) {
+        errx(EXIT_FAILURE, "took over %d listening sockets, need %d (-a)", taken, nlisten);
+    }
+    for (int j = 0; j < nlisten; j++) {
+        if (taken == 0) {
+            listenfds[j] = create_listen_socket(port, listeners > 0);
+        } else if (socket_port(listenfds[j]) != port) {
+            errx(EXIT_FAILURE, "the listening sockets taken over are not on port %" PRIu16, port);
+        }
+        // accept() until EAGAIN, then poll() beside the drain eventfd; an
+        // io_uring accept waits for a connection either way. The flag is shared
+        // with every other server holding the socket, so they all agree on it.
+        fcntl(listenfds[j], F_SETFL, fcntl(listenfds[j], F_GETFL) | O_NONBLOCK);
+        if (pin && listeners > 0) {
+            // steer connections whose packets this CPU handles to the listener
+            // whose (first) worker runs on it
+            int cpu = nth_cpu(&allowed, j);
+            setsockopt(listenfds[j], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        }
+    }
+    int listenfd = listenfds[0];
+    drain.listenfds = listenfds;
+    drain.nlisten = nlisten;
+    bool acceptor = mode == THREADS && listeners == 0;
+    atomic_init(&drain.accepting, acceptor ? 0 : threads);
+    //LOG("port=%" PRIu16 ", threads=%d\n", port, threads);
 
     thread_pool = (reqThread **) malloc(sizeof(reqThread *) * threads);
+    pool.min = min_threads;
+    pool.max = threads;
+    atomic_init(&pool.live, min_threads);
+    metrics_workers(&pool.live);
 
     for (int i = 0; i < threads; i++) {
         thread_pool[i] = (reqThread *) malloc(sizeof(reqThread));
 
         thread_pool[i]->thread_id = i;
         thread_pool[i]->thread = (pthread_t *) malloc(sizeof(pthread_t));
-        if (pthread_create(thread_pool[i]->thread, NULL, worker_thread, NULL) != 0) {
+        thread_pool[i]->listenfd = listenfds[i % nlisten];
+        thread_pool[i]->cpu = pin ? nth_cpu(&allowed, i) : -1;
+        atomic_init(&thread_pool[i]->state, SLOT_FREE);
+        if (i >= min_threads) {
+            continue; // started by pool_controller when needed
+        }
+        void *(*worker)(void *) = mode == EPOLL   ? event_worker
+                                  : mode == URING ? uring_worker
+                                  : listeners > 0 ? accept_worker
+                                                  : worker_thread;
+        void *arg = mode == THREADS ? (void *) thread_pool[i] : &thread_pool[i]->listenfd;
+        start_worker(thread_pool[i], worker, arg);
+    }
+    pthread_t controller;
+    if (pool_scales()) {
+        if (pthread_create(&controller, NULL, pool_controller, NULL) != 0) {
             errx(EXIT_FAILURE, "pthread_create() failed");
         }
     }
 
-    int listenfd = create_listen_socket(port);
-    //LOG("port=%" PRIu16 ", threads=%d\n", port, threads);
+    if (handoff_conn >= 0) {
+        handoff_done(handoff_conn); // the workers are accepting; the old server can go
+    }
+    int upgrade_fd = -1;
+    if (upgrade_path != NULL) {
+        upgrade_fd = handoff_listen(upgrade_path);
+        pthread_t handoff;
+        if (pthread_create(&handoff, NULL, handoff_thread, &upgrade_fd) != 0) {
+            errx(EXIT_FAILURE, "pthread_create() failed");
+        }
+        pthread_detach(handoff);
+    }
 
-    for (;;) {
-        int connfd = accept(listenfd, NULL, NULL);
-        if (connfd < 0) {
+    pthread_sigmask(SIG_UNBLOCK, &main_only, NULL);
+
+    // the other engines, and workers with their own listeners, accept for
+    // themselves; main only reports stats
+    while (!acceptor && !draining()) {
+        struct pollfd pfd = { .fd = drain.fd, .events = POLLIN };
+        poll(&pfd, 1, -1);
+        report_stats();
+    }
+
+    int last = LISTEN_BACKLOG; // connections still taken once draining
+    while (acceptor) {
+        int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        report_stats();
+        if (connfd >= 0) {
+            //handle_connection(connfd);
+            //close(connfd);
+            admit(connfd, policy);
+            if (draining() && --last == 0) {
+                break;
+            }
+        } else if (errno == EAGAIN) {
+            if (draining()) {
+                break; // the backlog is in the queue
+            }
+            wait_listener(listenfd);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
             warn("accept error");
-            continue;
         }
-        //handle_connection(connfd);
-        //close(connfd);
-        enqueue(connfd);
+    }
+
+    // Drain: once nothing accepts any more, close the listeners (a successor
+    // keeps them open) and give the workers until the deadline.
+    warnx("draining");
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain.seconds;
+    if (acceptor) {
+        queueClose();
+    }
+    struct timespec tick = { .tv_nsec = 1000000 };
+    struct timespec now = { 0 };
+    while (atomic_load(&drain.accepting) > 0 && now.tv_sec < deadline.tv_sec) {
+        nanosleep(&tick, NULL);
+        clock_gettime(CLOCK_REALTIME, &now);
+    }
+    for (int j = 0; j < nlisten; j++) {
+        close(listenfds[j]);
+    }
+    if (pool_scales()) {
+        pthread_join(controller, NULL);
+    }
+    int busy = 0;
+    for (int i = 0; i < threads; i++) {
+        if (atomic_load(&thread_pool[i]->state) != SLOT_FREE
+            && pthread_timedjoin_np(*thread_pool[i]->thread, NULL, &deadline) != 0) {
+            busy++;
+        }
+    }
+    log_close();
+    if (busy > 0) {
+        // they may still be using what would be freed below
+        warnx("%d workers still busy after %d s; exiting anyway", busy, drain.seconds);
+        return EXIT_SUCCESS;
     }
 
     for (int i = 0; i < threads; i++) {
-        pthread_join(*(thread_pool[i]->thread), NULL);
         free(thread_pool[i]->thread);
         free(thread_pool[i]);
     }
 
     free(thread_pool);
+    free(listenfds);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,148 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define VERSION    "HTTP/1.1"
+#define BUF_SIZE   4096
+#define VALUE_SIZE 2048
+#define HEADER_SIZE 128 // room for any get_response() header
+#define LISTEN_BACKLOG 128 // listen(); also the most a draining worker still accepts
+#define DRAIN_IDLE_MS 500 // draining: close a connection idle between requests this long
+
+typedef enum key {
+    GET,
+    PUT,
+    APPEND,
+    REQUEST_ID,
+    HOST,
+    USER_AGENT,
+    ACCEPT,
+    CONTENT_LENGTH,
+    CONTENT_TYPE,
+    EXPECT,
+    CONNECTION,
+    TOTAL,
+} key;
+
+// A piece of the request buffer; not NUL-terminated
+typedef struct Slice {
+    const char *ptr;
+    size_t len;
+} Slice;
+
+typedef struct Request {
+    int socket;
+
+    int method; // Method (GET, PUT, APPEND, or TOTAL for anything else)
+    Slice method_name; // Method as sent, for the log
+    char path[100]; // URI
+    char tmp_path[128]; // staged PUT/APPEND: temp file the body goes to until commit_temp()
+    Slice version; // Version
+
+    unsigned long int cnt_len; // Content-Length
+    int req_id; //Request-Id
+
+    size_t hdr_len; // Bytes of the header, including the blank line
+    char *msg_bdy; // Bytes that arrived after the header (not NUL-terminated); the body
+    size_t bdy_len; // comes first, anything past Content-Length is the next request
+    off_t read_len; // GET: size of the file being sent
+
+    uint64_t start_ns; // CLOCK_MONOTONIC when the header was parsed (0: it was not)
+    uint64_t parse_ns; // time in the parser so far
+    uint64_t disk_ns; // time in file system calls so far (see metrics.h)
+    bool conn_close; // Connection: close, or the connection cannot be reused
+    pthread_rwlock_t *lock; // per-path lock held while the file is in use (see lock.h)
+    struct OpenFile *open_file; // GET: the fd cache entry the file came from (see fdcache.h)
+} Request;
+
+// Seconds a keep-alive connection may sit idle between requests (0: no limit)
+extern int idle_timeout;
+
+// Graceful shutdown, started by SIGTERM or a handoff to a successor (see
+// handoff.h). Every engine then takes what is left in the listen backlog (at
+// most LISTEN_BACKLOG more connections) and stops accepting, finishes the
+// requests it has (their responses carry Connection: close, see log_response()),
+// and closes the connections idling between requests once DRAIN_IDLE_MS pass
+// without one (a request already on its way is not cut off); its workers
+// return once they have none left.
+bool draining(void);
+// An eventfd that turns readable when the drain starts, for waits on sockets.
+int drain_fd(void);
+// Called once by each worker that accepts for itself (-e epoll|uring, -a)
+// when it has taken its last connection.
+void stopped_accepting(void);
+
+// How far PUT/APPEND push the data towards the disk before replying (-d)
+typedef enum durability {
+    SYNC_NONE, // leave it in the page cache
+    SYNC_DATA, // fdatasync() the file
+    SYNC_FULL, // fsync() the file, and the directory after a PUT's rename
+} durability;
+extern durability sync_mode;
+
+const char *Phrase(int code);
+int check_format(Request *req);
+
+// Bytes of the read buffer this request occupies: header plus buffered body.
+// Whatever follows belongs to the next (pipelined) request.
+size_t request_size(const Request *req);
+// The body is not going to be read; unless it is already in the buffer the
+// next request cannot be found, so the connection is closed after the reply.
+void discard_body(Request *req);
+
+// Open the file behind a request. On failure return -1 and set *status to the
+// error to send back (0: send nothing). On success *status is the code to send
+// once the method completes (a staged body's is only known at commit_temp()),
+// and GET sets req->read_len. A staged body goes to a new temp file, so it needs
+// no lock until then.
+int open_get(Request *req, int *status);
+// GET through the content cache (cache.h): a referenced entry to send on a hit
+// or a fresh fill (or the metrics, see metrics.h). Otherwise NULL, with *fd and
+// *status as from open_get(); *fd may come from the fd cache (-F), so it is
+// read at explicit offsets and handed back with close_get().
+struct CacheEntry *open_cached(Request *req, int *fd, int *status);
+void close_get(Request *req, int fd);
+int open_put_append(Request *req, int *status);
+// Whether the body goes to a temp file before the path is locked: always for a
+// PUT, and for an APPEND unless all of it came with the header (written in
+// place then, from memory, so no client can stall the lock holder).
+bool body_staged(const Request *req);
+// Pick req->tmp_path for a staged body (open_put_append() does this itself).
+void make_temp_path(Request *req);
+// Whether name is one of this process's make_temp_path() names.
+bool is_temp_path(const char *name);
+// Push a stored body to disk as -d asks; -1 on failure. A staged APPEND's temp
+// file is left alone, commit_temp() syncs the target.
+int sync_file(Request *req, int fd);
+// With the path locked exclusively: rename a PUT's temp file over the target,
+// or copy an APPEND's onto its end, and remove the temp file. Returns the
+// status to send (PUT 200/201, APPEND 200/403/404, or 500).
+int commit_temp(Request *req);
+// Delete a temp file that will not be committed.
+void remove_temp(Request *req);
+
+// Log the response. The log line is where the request takes effect, so the
+// path lock is released right after it. While draining it also sets conn_close
+// (before the response header is built) unless the next request is buffered.
+void log_response(Request *req, int status);
+
+// Status-only replies (everything but a GET's 200) are prebuilt constant
+// buffers, one per status and combination of these optional headers.
+#define REPLY_CLOSE 1 // Connection: close
+#define REPLY_RETRY 2 // Retry-After
+void replies_init(void);
+Slice status_reply(int status, unsigned headers);
+// log_response(), then the prebuilt reply for the request.
+Slice status_response(Request *req, int status);
+// "HTTP/1.1 200 OK\r\nContent-Length: <len>\r\n" into out; returns its length.
+size_t ok_header(off_t len, char *out);
+// log_response(), then a GET's whole 200 header (up to HEADER_SIZE bytes) into out.
+size_t get_response(Request *req, char *out);
+void send_response(Request *req, int status);
+
+#endif
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "io.h"
+
+// Largest chunk handed to the kernel per call; keeps memory per request constant.
+#define CHUNK_SIZE (1 << 20)
+#define COPY_SIZE  4096
+
+// sendfile:
+// https://man7.org/linux/man-pages/man2/sendfile.2.html
+// splice:
+// https://man7.org/linux/man-pages/man2/splice.2.html
+
+ssize_t write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = write(fd, p + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Last resort: plain read()/write() through a fixed stack buffer.
+static ssize_t copy_file(int out_fd, int in_fd, size_t len, size_t sent) {
+    char buf[COPY_SIZE];
+    while (sent < len) {
+        size_t want = len - sent < COPY_SIZE ? len - sent : COPY_SIZE;
+        ssize_t n = pread(in_fd, buf, want, sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : (ssize_t) sent;
+        }
+        if (write_all(out_fd, buf, n) < 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// splice() file -> pipe -> socket, for when sendfile() is not supported.
+static ssize_t splice_file(int out_fd, int in_fd, size_t len, size_t sent) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        return copy_file(out_fd, in_fd, len, sent);
+    }
+
+    while (sent < len) {
+        size_t want = len - sent < CHUNK_SIZE ? len - sent : CHUNK_SIZE;
+        loff_t off = sent;
+        ssize_t in = splice(in_fd, &off, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && (errno == EINVAL || errno == ENOSYS) && sent == 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return copy_file(out_fd, in_fd, len, sent);
+        }
+        if (in <= 0) {
+            break;
+        }
+        // drain the pipe into the socket
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            in -= out;
+            sent += out;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return sent;
+}
+
+ssize_t send_file(int out_fd, int in_fd, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        size_t want = len - sent < CHUNK_SIZE ? len - sent : CHUNK_SIZE;
+        off_t off = sent;
+        ssize_t n = sendfile(out_fd, in_fd, &off, want);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && sent == 0) {
+                return splice_file(out_fd, in_fd, len, sent);
+            }
+            return -1;
+        }
+        if (n == 0) { // file shrank underneath us
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Fallback for copy_range(): pread() into a fixed buffer and pwrite() it out.
+static ssize_t copy_positioned(int out_fd, off_t at, int in_fd, size_t len, size_t done) {
+    char buf[COPY_SIZE];
+    while (done < len) {
+        size_t want = len - done < COPY_SIZE ? len - done : COPY_SIZE;
+        ssize_t n = pread(in_fd, buf, want, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : (ssize_t) done;
+        }
+        for (ssize_t put = 0; put < n;) {
+            ssize_t w = pwrite(out_fd, buf + put, n - put, at + done + put);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w < 0) {
+                return -1;
+            }
+            put += w;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// copy_file_range() keeps the data in the kernel (or shares the blocks, on file
+// systems that can); it refuses some pairs of files, which then take the fallback.
+ssize_t copy_range(int out_fd, off_t at, int in_fd, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        loff_t in_off = done, out_off = at + done;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && done == 0
+            && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            return copy_positioned(out_fd, at, in_fd, len, done);
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Fallback for recv_file(): read() into a fixed buffer and write() it out.
+static ssize_t copy_socket(int out_fd, int in_fd, size_t len, size_t got) {
+    char buf[CHUNK_SIZE / 16];
+    while (got < len) {
+        size_t want = len - got < sizeof(buf) ? len - got : sizeof(buf);
+        ssize_t n = read(in_fd, buf, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : (ssize_t) got;
+        }
+        if (write_all(out_fd, buf, n) < 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+ssize_t recv_file(int out_fd, int in_fd, size_t len) {
+    size_t got = 0;
+    int pipefd[2];
+    if (len == 0) {
+        return 0;
+    }
+    // splice() refuses files opened with O_APPEND
+    if ((fcntl(out_fd, F_GETFL) & O_APPEND) || pipe(pipefd) < 0) {
+        return copy_socket(out_fd, in_fd, len, got);
+    }
+
+    // socket -> pipe -> file, the data never enters user space
+    while (got < len) {
+        size_t want = len - got < CHUNK_SIZE ? len - got : CHUNK_SIZE;
+        ssize_t in = splice(in_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && (errno == EINVAL || errno == ENOSYS) && got == 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return copy_socket(out_fd, in_fd, len, got);
+        }
+        if (in < 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+        if (in == 0) { // peer closed before sending Content-Length bytes
+            break;
+        }
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            in -= out;
+            got += out;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return got;
+}
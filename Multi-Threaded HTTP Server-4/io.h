@@ -0,0 +1,14 @@
+#include <sys/types.h>
+
+// write() until all len bytes are out or an error occurs
+ssize_t write_all(int fd, const void *buf, size_t len);
+// Stream the first len bytes of in_fd to out_fd. The file offset is left
+// alone, so in_fd may be shared (see fdcache.h).
+// Returns the number of bytes sent, or -1 on error.
+ssize_t send_file(int out_fd, int in_fd, size_t len);
+// Copy the first len bytes of the file in_fd into the file out_fd at offset at.
+// Returns the number of bytes copied (less than len if in_fd is shorter), -1 on error.
+ssize_t copy_range(int out_fd, off_t at, int in_fd, size_t len);
+// Stream exactly len bytes from in_fd (a socket) into out_fd.
+// Returns the number of bytes stored; less than len if the peer closed early, -1 on error.
+ssize_t recv_file(int out_fd, int in_fd, size_t len);
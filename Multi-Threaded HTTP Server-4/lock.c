@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+#define CACHE_LINE  64
+#define LOCK_SHARDS 1024 // power of two
+
+// One lock per cache line, so threads on neighbouring shards do not false-share.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_rwlock_t lock; // first: a lock pointer is its shard's
+    atomic_int waiters; // lock_notify() registrations
+} Shard;
+
+static Shard shards[LOCK_SHARDS];
+
+// Event loops waiting for a shard to be released. Only contended locks get
+// here; an uncontended unlock only reads the shard's waiters count.
+static struct {
+    pthread_mutex_t mutex;
+    struct waiter {
+        Shard *shard;
+        int fd;
+    } *list;
+    size_t n, cap;
+} waiting = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void locks_init(void) {
+    // glibc rwlocks prefer readers by default: a steady stream of GETs would
+    // starve a PUT forever. Waiting writers go first instead.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (size_t i = 0; i < LOCK_SHARDS; i++) {
+        if (pthread_rwlock_init(&shards[i].lock, &attr) != 0) {
+            errx(EXIT_FAILURE, "pthread_rwlock_init");
+        }
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char) *path) * 16777619u;
+    }
+    return h;
+}
+
+static pthread_rwlock_t *path_lock(const char *path) {
+    return &shards[path_hash(path) & (LOCK_SHARDS - 1)].lock;
+}
+
+void lock_request(Request *req) {
+    req->lock = path_lock(req->path);
+    if (req->method == GET) {
+        pthread_rwlock_rdlock(req->lock);
+    } else {
+        pthread_rwlock_wrlock(req->lock);
+    }
+}
+
+// Register fd for s once.
+static void add_waiter(Shard *s, int fd) {
+    pthread_mutex_lock(&waiting.mutex);
+    for (size_t i = 0; i < waiting.n; i++) {
+        if (waiting.list[i].shard == s && waiting.list[i].fd == fd) {
+            pthread_mutex_unlock(&waiting.mutex);
+            return;
+        }
+    }
+    if (waiting.n == waiting.cap) {
+        size_t cap = waiting.cap ? waiting.cap * 2 : 16;
+        struct waiter *list = realloc(waiting.list, cap * sizeof(*list));
+        if (list == NULL) {
+            err(EXIT_FAILURE, "lock waiters");
+        }
+        waiting.list = list;
+        waiting.cap = cap;
+    }
+    waiting.list[waiting.n++] = (struct waiter) { s, fd };
+    atomic_fetch_add(&s->waiters, 1);
+    pthread_mutex_unlock(&waiting.mutex);
+}
+
+// Wake whoever waits for s (or, with s NULL, drop fd's registrations unsent).
+static void remove_waiters(Shard *s, int fd) {
+    uint64_t one = 1;
+    pthread_mutex_lock(&waiting.mutex);
+    for (size_t i = 0; i < waiting.n;) {
+        struct waiter *w = &waiting.list[i];
+        if (s != NULL ? w->shard != s : w->fd != fd) {
+            i++;
+            continue;
+        }
+        if (s != NULL) {
+            write(w->fd, &one, sizeof(one)); // EAGAIN: a wakeup is already pending
+        }
+        atomic_fetch_sub(&w->shard->waiters, 1);
+        *w = waiting.list[--waiting.n];
+    }
+    pthread_mutex_unlock(&waiting.mutex);
+}
+
+bool trylock_request_notify(Request *req, int fd) {
+    if (trylock_request(req)) {
+        return true;
+    }
+    add_waiter((Shard *) path_lock(req->path), fd);
+    // released between the failed try and the registration: nobody would write fd
+    return trylock_request(req);
+}
+
+void lock_forget(int fd) {
+    remove_waiters(NULL, fd);
+}
+
+bool trylock_request(Request *req) {
+    pthread_rwlock_t *lock = path_lock(req->path);
+    int rc = req->method == GET ? pthread_rwlock_tryrdlock(lock) : pthread_rwlock_trywrlock(lock);
+    if (rc != 0) {
+        return false;
+    }
+    req->lock = lock;
+    return true;
+}
+
+void unlock_request(Request *req) {
+    if (req->lock != NULL) {
+        Shard *s = (Shard *) req->lock;
+        pthread_rwlock_unlock(req->lock);
+        req->lock = NULL;
+        if (atomic_load(&s->waiters) > 0) {
+            remove_waiters(s, -1);
+        }
+    }
+}
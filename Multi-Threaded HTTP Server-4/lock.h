@@ -0,0 +1,27 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "httpserver.h"
+
+// Per-path reader/writer locks. Paths hash onto a fixed table of rwlocks, so
+// GETs of one file share it, PUT/APPEND get it alone, and unrelated files only
+// meet when they land in the same shard.
+void locks_init(void);
+// Shared for GET, exclusive for PUT/APPEND; blocks until granted.
+void lock_request(Request *req);
+// Same, for event loops that must never sleep: false if the lock is busy.
+bool trylock_request(Request *req);
+// trylock_request(); if the lock is busy, fd (an eventfd) is also written once
+// it is released, so an event loop can sleep until then instead of polling.
+bool trylock_request_notify(Request *req, int fd);
+// fd is about to close: drop what trylock_request_notify() registered for it.
+void lock_forget(int fd);
+// Release the lock req holds, if any, and wake the event loops waiting for it.
+void unlock_request(Request *req);
+// FNV-1a of a path; also shards the content cache.
+uint32_t path_hash(const char *path);
+
+#endif
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "httpserver.h"
+#include "log.h"
+
+#define CACHE_LINE     64
+#define LOG_RING_SIZE  1024 // records per thread, power of two
+#define LOG_MAX_RINGS  1024
+#define LOG_METHOD_MAX 31 // longer method names are cut short in the log
+#define LOG_LINE_MAX   (LOG_METHOD_MAX + sizeof(((Request *) 0)->path) + 32)
+#define LOG_NAMES      4096 // binary: names remembered per segment, power of two
+
+_Static_assert(sizeof(LogHeader) == LOG_RECORD_SIZE, "LogHeader is one slot");
+_Static_assert(sizeof(LogName) == LOG_RECORD_SIZE, "LogName is one slot");
+_Static_assert(sizeof(LogResponse) == LOG_RECORD_SIZE, "LogResponse is one slot");
+
+// What log_response() knows about a request; the log thread does the formatting.
+typedef struct {
+    uint64_t seq; // position in the log
+    uint64_t time_ns; // CLOCK_REALTIME
+    uint32_t latency_us;
+    int status;
+    int req_id;
+    uint8_t method_len;
+    char method[LOG_METHOD_MAX];
+    char path[sizeof(((Request *) 0)->path)];
+} Record;
+
+// Single producer (the thread that claimed it), single consumer (the log thread).
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic size_t head; // next record to write out
+    _Alignas(CACHE_LINE) _Atomic size_t tail; // next free slot
+    _Atomic bool owned; // a live thread logs into it
+    Record slots[LOG_RING_SIZE];
+} LogRing;
+
+// Eventcount, as in queue.c: wakers only make the futex syscall when somebody
+// is actually asleep.
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+} Event;
+
+static struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t seq; // next record number
+    LogRing *rings[LOG_MAX_RINGS];
+    _Atomic int nrings;
+    pthread_mutex_t claim; // taken only when a thread logs for the first time
+    pthread_key_t key; // hands a ring back when its thread exits
+
+    Event wake; // log thread: records are piling up
+    Event drained; // workers with a full ring: there is room again
+    _Atomic bool rotate; // SIGHUP
+    _Atomic bool stop;
+    pthread_t thread;
+
+    // owned by the log thread
+    log_format format;
+    const char *path;
+    int fd;
+    long interval_ms;
+    size_t batch;
+    size_t rotate_bytes;
+    long rotate_ms;
+    size_t written; // text: bytes in the current file
+    struct timespec opened; // when the current file or segment was started
+    uint32_t segment; // n of the next <logfile>.n
+    char *buf;
+    size_t len;
+    uint64_t next; // the record that goes out next
+    struct timespec flushed; // when buf was last written out
+
+    // binary: the mapped segment and the names defined in it so far
+    char *map; // NULL after a failed rotation; records are dropped until a new segment opens
+    size_t segment_size;
+    size_t slots; // slots used
+    struct {
+        uint32_t id; // 0: free
+        uint32_t hash;
+        uint8_t len;
+        char text[sizeof(((Request *) 0)->path)];
+    } *names;
+    uint32_t nnames;
+    uint32_t last_id; // ids count up through the whole segment, forgotten names included
+} logger;
+
+static __thread LogRing *my_ring;
+
+static void event_wait(Event *ev, uint32_t seen, const struct timespec *timeout) {
+    syscall(SYS_futex, (uint32_t *) &ev->seq, FUTEX_WAIT_PRIVATE, seen, timeout, NULL, 0);
+}
+
+static void event_signal(Event *ev) {
+    atomic_fetch_add(&ev->seq, 1);
+    if (atomic_load(&ev->waiters) > 0) {
+        syscall(SYS_futex, (uint32_t *) &ev->seq, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+    }
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long elapsed_ms(const struct timespec *since, const struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void release_ring(void *ring) {
+    atomic_store(&((LogRing *) ring)->owned, false);
+}
+
+// Records still in a ring handed back by an exited thread carry smaller
+// numbers than anything its next owner logs, so reusing it keeps it in order.
+static LogRing *claim_ring(void) {
+    pthread_mutex_lock(&logger.claim);
+    int n = atomic_load(&logger.nrings);
+    LogRing *r = NULL;
+    for (int i = 0; i < n && r == NULL; i++) {
+        if (!atomic_load(&logger.rings[i]->owned)) {
+            r = logger.rings[i];
+        }
+    }
+    if (r == NULL) {
+        if (n == LOG_MAX_RINGS) {
+            errx(EXIT_FAILURE, "too many logging threads");
+        }
+        r = aligned_alloc(CACHE_LINE, sizeof(LogRing));
+        if (r == NULL) {
+            err(EXIT_FAILURE, "log ring");
+        }
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        logger.rings[n] = r;
+        atomic_store(&logger.nrings, n + 1);
+    }
+    atomic_store(&r->owned, true);
+    pthread_mutex_unlock(&logger.claim);
+
+    pthread_setspecific(logger.key, r);
+    my_ring = r;
+    return r;
+}
+
+void log_record(const Request *req, int status) {
+    LogRing *r = my_ring != NULL ? my_ring : claim_ring();
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    // Full: wait for the log thread, holding on to the path lock meanwhile so
+    // the order of the log still matches the order of the responses.
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add(&logger.drained.waiters, 1);
+        uint32_t seen = atomic_load(&logger.drained.seq);
+        event_signal(&logger.wake);
+        if (tail - atomic_load(&r->head) == LOG_RING_SIZE) {
+            event_wait(&logger.drained, seen, NULL);
+        }
+        atomic_fetch_sub(&logger.drained.waiters, 1);
+    }
+
+    Record *rec = &r->slots[tail & (LOG_RING_SIZE - 1)];
+    rec->seq = atomic_fetch_add(&logger.seq, 1);
+    if (logger.format == LOG_BINARY) {
+        rec->time_ns = clock_ns(CLOCK_REALTIME);
+        rec->latency_us = req->start_ns ? (clock_ns(CLOCK_MONOTONIC) - req->start_ns) / 1000 : 0;
+    }
+    rec->status = status;
+    rec->req_id = req->req_id;
+    rec->method_len = req->method_name.len < LOG_METHOD_MAX ? req->method_name.len : LOG_METHOD_MAX;
+    memcpy(rec->method, req->method_name.ptr, rec->method_len);
+    snprintf(rec->path, sizeof(rec->path), "%s", req->path);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    // Otherwise the log thread comes by on its own every interval.
+    if (logger.interval_ms == 0
+        || tail + 1 - atomic_load_explicit(&r->head, memory_order_relaxed) >= LOG_RING_SIZE / 2) {
+        event_signal(&logger.wake);
+    }
+}
+
+static void open_segment(void);
+static void rotate_text(void);
+
+static void flush(void) {
+    if (logger.format == LOG_BINARY) {
+        // records go straight into the mapping; only retry a failed rotation
+        if (logger.map == NULL) {
+            open_segment();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &logger.flushed);
+        return;
+    }
+    size_t off = 0;
+    while (off < logger.len) {
+        ssize_t n = write(logger.fd, logger.buf + off, logger.len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            warn("log write");
+            break;
+        }
+        off += n;
+    }
+    logger.written += off;
+    logger.len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &logger.flushed);
+    // between batches, so no line is split over two files
+    if (logger.rotate_bytes > 0 && logger.written >= logger.rotate_bytes) {
+        rotate_text();
+    }
+}
+
+// Start a new text log. If the file was moved away already (logrotate and
+// SIGHUP), only open a new one; otherwise rename it to <logfile>.n first. The
+// old file stays in use unless the new one opens.
+static void rotate_text(void) {
+    if (logger.path == NULL) {
+        return;
+    }
+    struct stat cur, named;
+    if (fstat(logger.fd, &cur) == 0 && stat(logger.path, &named) == 0
+        && cur.st_dev == named.st_dev && cur.st_ino == named.st_ino) {
+        char name[PATH_MAX];
+        for (;;) { // never over a file that is already there
+            snprintf(name, sizeof(name), "%s.%u", logger.path, logger.segment);
+            if (renameat2(AT_FDCWD, logger.path, AT_FDCWD, name, RENAME_NOREPLACE) == 0) {
+                break;
+            }
+            if (errno != EEXIST) {
+                warn("log rotation: %s", name);
+                return;
+            }
+            logger.segment++;
+        }
+        logger.segment++;
+    }
+    int fd = open(logger.path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        warn("log rotation: %s", logger.path);
+        return;
+    }
+    close(logger.fd);
+    logger.fd = fd;
+    logger.written = 0;
+    clock_gettime(CLOCK_MONOTONIC, &logger.opened);
+}
+
+static void format_text(const Record *rec) {
+    logger.len += snprintf(logger.buf + logger.len, LOG_LINE_MAX, "%.*s,/%s,%d,%d\n",
+        (int) rec->method_len, rec->method, rec->path, rec->status, rec->req_id);
+    if (logger.len >= logger.batch) {
+        flush();
+    }
+}
+
+// Shrink the finished segment to the slots it used.
+static void close_segment(void) {
+    if (logger.map == NULL) {
+        return;
+    }
+    munmap(logger.map, logger.segment_size);
+    logger.map = NULL;
+    if (ftruncate(logger.fd, logger.slots * LOG_RECORD_SIZE) < 0) {
+        warn("log segment %u", logger.segment);
+    }
+    close(logger.fd);
+    logger.segment++;
+}
+
+static void open_segment(void) {
+    char name[PATH_MAX];
+    for (;;) { // never over a segment that is already there
+        snprintf(name, sizeof(name), "%s.%u", logger.path, logger.segment);
+        logger.fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (logger.fd >= 0 || errno != EEXIST) {
+            break;
+        }
+        logger.segment++;
+    }
+    if (logger.fd < 0) {
+        warn("log segment %s", name);
+        return;
+    }
+    int rc = posix_fallocate(logger.fd, 0, logger.segment_size);
+    void *map = MAP_FAILED;
+    if (rc == 0) {
+        map = mmap(NULL, logger.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, logger.fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        warnx("log segment %s: %s", name, strerror(rc ? rc : errno));
+        close(logger.fd);
+        return;
+    }
+    logger.map = map;
+
+    LogHeader *h = (LogHeader *) logger.map;
+    h->record_size = LOG_RECORD_SIZE;
+    h->segment = logger.segment;
+    memcpy(h->magic, LOG_MAGIC, sizeof(h->magic));
+    h->created_ns = clock_ns(CLOCK_REALTIME);
+    h->kind = LOG_HEADER;
+    logger.slots = 1;
+    clock_gettime(CLOCK_MONOTONIC, &logger.opened);
+
+    memset(logger.names, 0, LOG_NAMES * sizeof(*logger.names));
+    logger.nnames = 0;
+    logger.last_id = 0;
+}
+
+// The id of a name in the current segment, defining it first if it is new.
+static uint32_t intern(const char *text, size_t len) {
+    uint32_t hash = 2166136261u; // FNV-1a, like path_hash()
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) text[i]) * 16777619u;
+    }
+    uint32_t i = hash & (LOG_NAMES - 1);
+    for (; logger.names[i].id != 0; i = (i + 1) & (LOG_NAMES - 1)) {
+        if (logger.names[i].hash == hash && logger.names[i].len == len
+            && memcmp(logger.names[i].text, text, len) == 0) {
+            return logger.names[i].id;
+        }
+    }
+    // too many names: forget them all and define them again as they come
+    if (logger.nnames == LOG_NAMES * 3 / 4) {
+        memset(logger.names, 0, LOG_NAMES * sizeof(*logger.names));
+        logger.nnames = 0;
+        i = hash & (LOG_NAMES - 1);
+    }
+    logger.nnames++;
+    uint32_t id = ++logger.last_id;
+    logger.names[i].id = id;
+    logger.names[i].hash = hash;
+    logger.names[i].len = len;
+    memcpy(logger.names[i].text, text, len);
+
+    LogName *n = (LogName *) (logger.map + logger.slots * LOG_RECORD_SIZE);
+    n->len = len;
+    n->id = id;
+    memcpy(n->text, text, len);
+    n->kind = LOG_NAME;
+    logger.slots += LOG_NAME_SLOTS(len);
+    return id;
+}
+
+static void format_binary(const Record *rec) {
+    // room for the response and, worst case, a path and a method name
+    size_t need = 1 + 2 * LOG_NAME_SLOTS(sizeof(rec->path) - 1);
+    if (logger.map != NULL && logger.slots + need > logger.segment_size / LOG_RECORD_SIZE) {
+        close_segment();
+        open_segment();
+    }
+    if (logger.map == NULL) {
+        return;
+    }
+
+    static const struct {
+        const char *name;
+        uint8_t method;
+    } methods[] = { { "GET", LOG_GET }, { "PUT", LOG_PUT }, { "APPEND", LOG_APPEND } };
+    uint8_t method = LOG_OTHER;
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (rec->method_len == strlen(methods[i].name)
+            && memcmp(rec->method, methods[i].name, rec->method_len) == 0) {
+            method = methods[i].method;
+        }
+    }
+    uint32_t method_id = method == LOG_OTHER ? intern(rec->method, rec->method_len) : 0;
+    uint32_t path_id = intern(rec->path, strlen(rec->path));
+
+    LogResponse *r = (LogResponse *) (logger.map + logger.slots * LOG_RECORD_SIZE);
+    r->method = method;
+    r->status = rec->status;
+    r->path_id = path_id;
+    r->method_id = method_id;
+    r->req_id = rec->req_id;
+    r->time_ns = rec->time_ns;
+    r->latency_us = rec->latency_us;
+    r->kind = LOG_RESPONSE;
+    logger.slots++;
+}
+
+static void format(const Record *rec) {
+    if (logger.format == LOG_BINARY) {
+        format_binary(rec);
+    } else {
+        format_text(rec);
+    }
+}
+
+// Move records into buf in number order. Every ring is in order already, so
+// this is a merge: keep taking the record numbered next from whichever ring
+// has it at its head. Stops when that record is not in any ring yet (its
+// thread is between numbering and publishing it).
+static void drain(void) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        int n = atomic_load(&logger.nrings);
+        for (int i = 0; i < n; i++) {
+            LogRing *r = logger.rings[i];
+            size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            size_t first = head;
+            while (head != tail && r->slots[head & (LOG_RING_SIZE - 1)].seq == logger.next) {
+                format(&r->slots[head & (LOG_RING_SIZE - 1)]);
+                head++;
+                logger.next++;
+            }
+            if (head != first) {
+                atomic_store_explicit(&r->head, head, memory_order_release);
+                progress = true;
+            }
+        }
+    }
+    event_signal(&logger.drained);
+}
+
+// Start a new file (text) or segment (binary). On time alone an empty one is
+// kept and its clock restarted.
+static void rotate(bool forced) {
+    bool empty = logger.format == LOG_BINARY ? logger.slots <= 1 : logger.written == 0 && logger.len == 0;
+    if (!forced && empty) {
+        clock_gettime(CLOCK_MONOTONIC, &logger.opened);
+        return;
+    }
+    if (logger.format == LOG_BINARY) {
+        close_segment();
+        open_segment();
+    } else {
+        flush();
+        rotate_text();
+    }
+}
+
+static void *log_thread(void *arg) {
+    (void) arg;
+    for (;;) {
+        uint32_t seen = atomic_load(&logger.wake.seq);
+        bool stop = atomic_load(&logger.stop);
+        bool hup = atomic_exchange(&logger.rotate, false);
+        drain();
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = logger.interval_ms - elapsed_ms(&logger.flushed, &now);
+        if (stop || left <= 0) {
+            flush();
+            left = logger.interval_ms;
+        }
+        if (stop) {
+            close_segment();
+            return NULL;
+        }
+        if (hup || (logger.rotate_ms > 0 && elapsed_ms(&logger.opened, &now) >= logger.rotate_ms)) {
+            rotate(hup);
+        }
+
+        // sleep until the next flush or time-based rotation, whichever is first
+        long sleep_ms = logger.interval_ms > 0 ? left : -1;
+        if (logger.rotate_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long due = logger.rotate_ms - elapsed_ms(&logger.opened, &now);
+            due = due > 0 ? due : 0;
+            sleep_ms = sleep_ms < 0 || due < sleep_ms ? due : sleep_ms;
+        }
+        struct timespec timeout = { sleep_ms / 1000, (sleep_ms % 1000) * 1000000 };
+        atomic_fetch_add(&logger.wake.waiters, 1);
+        event_wait(&logger.wake, seen, sleep_ms >= 0 ? &timeout : NULL);
+        atomic_fetch_sub(&logger.wake.waiters, 1);
+    }
+}
+
+// One past the highest n of the <logfile>.n files already there, so that a
+// restart carries on numbering instead of starting over at 0.
+static uint32_t next_segment(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *base = slash != NULL ? slash + 1 : path;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int) (slash - path) : 0, path);
+    DIR *d = opendir(slash == NULL ? "." : dir[0] != '\0' ? dir : "/");
+    if (d == NULL) {
+        return 0;
+    }
+    size_t len = strlen(base);
+    uint32_t next = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, base, len) != 0 || e->d_name[len] != '.'
+            || !isdigit((unsigned char) e->d_name[len + 1])) {
+            continue;
+        }
+        char *end;
+        unsigned long n = strtoul(e->d_name + len + 1, &end, 10);
+        if (*end == '\0' && n < UINT32_MAX && n + 1 > next) {
+            next = n + 1;
+        }
+    }
+    closedir(d);
+    return next;
+}
+
+void log_open(const LogConfig *config) {
+    const char *path = config->path;
+    logger.format = config->format;
+    logger.path = path;
+    logger.fd = STDERR_FILENO;
+    logger.rotate_bytes = config->rotate_bytes;
+    logger.rotate_ms = config->rotate_seconds * 1000L;
+    logger.segment_size = config->rotate_bytes > 0 ? config->rotate_bytes : LOG_SEGMENT_SIZE;
+    if (path == NULL && (config->rotate_bytes > 0 || config->rotate_seconds > 0)) {
+        errx(EXIT_FAILURE, "log rotation needs a logfile (-l)");
+    }
+    if (path != NULL) {
+        logger.segment = next_segment(path);
+    }
+    if (logger.format == LOG_BINARY) {
+        if (path == NULL) {
+            errx(EXIT_FAILURE, "a binary log needs a logfile (-l)");
+        }
+        logger.names = malloc(LOG_NAMES * sizeof(*logger.names));
+        if (logger.names == NULL) {
+            err(EXIT_FAILURE, "log names");
+        }
+        open_segment();
+        if (logger.map == NULL) {
+            errx(EXIT_FAILURE, "bad logfile");
+        }
+    } else if (path != NULL) {
+        // a rotated log is a series: a restart adds to the current file, which
+        // -r then rotates at its full size
+        bool series = config->rotate_bytes > 0 || config->rotate_seconds > 0;
+        logger.fd = open(path, O_WRONLY | O_CREAT | (series ? O_APPEND : O_TRUNC), 0666);
+        if (logger.fd < 0) {
+            errx(EXIT_FAILURE, "bad logfile");
+        }
+        struct stat st;
+        if (series && fstat(logger.fd, &st) == 0) {
+            logger.written = st.st_size;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &logger.opened);
+    }
+    logger.interval_ms = config->interval_ms;
+    logger.batch = config->batch;
+    logger.buf = malloc(logger.batch + LOG_LINE_MAX);
+    if (logger.buf == NULL) {
+        err(EXIT_FAILURE, "log buffer");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &logger.flushed);
+    pthread_mutex_init(&logger.claim, NULL);
+    pthread_key_create(&logger.key, release_ring);
+
+    // Signals are for main: SIGUSR1's handler only sets a flag, and the stats
+    // are printed when main's poll() wakes up for it. The thread inherits
+    // main's mask, which blocks those signals; blocking them all here keeps
+    // that true whenever log_open() is called.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&logger.thread, NULL, log_thread, NULL) != 0) {
+        errx(EXIT_FAILURE, "pthread_create() failed");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void log_rotate(void) {
+    atomic_store(&logger.rotate, true);
+    event_signal(&logger.wake);
+}
+
+void log_close(void) {
+    atomic_store(&logger.stop, true);
+    event_signal(&logger.wake);
+    pthread_join(logger.thread, NULL);
+    if (logger.format == LOG_TEXT && logger.fd != STDERR_FILENO) {
+        close(logger.fd);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "httpserver.h"
+
+// Audit log. Workers never touch the log file: each thread hands its records
+// to a dedicated log thread through its own lock-free ring, and the log thread
+// formats them as "METHOD,/path,status,request-id" lines and writes them in
+// large batches. Records are numbered when they are logged (with the path lock
+// still held), and the log thread writes them strictly in that order.
+
+// Rotation (-r/-R, SIGHUP): a text log is renamed to <logfile>.0, <logfile>.1, ...
+// and a new <logfile> started. All of it happens on the log thread between two
+// batches; workers keep filling their rings meanwhile and never wait for it.
+//
+// -L binary: instead of text, the log is a series of segment files
+// <logfile>.0, <logfile>.1, ... Each is preallocated to the rotation size
+// (LOG_SEGMENT_SIZE unless -r says otherwise), mapped, and filled with
+// LOG_RECORD_SIZE-byte slots; it is cut down to the slots used when the next
+// one starts. tools/logdump.c turns segments back into text.
+#define LOG_MAGIC        "HTTPLOG1"
+#define LOG_RECORD_SIZE  32
+#define LOG_SEGMENT_SIZE (64 << 20)
+
+typedef enum log_format {
+    LOG_TEXT,
+    LOG_BINARY,
+} log_format;
+
+// Slot kinds; an all-zero slot ends the segment.
+enum {
+    LOG_END,
+    LOG_HEADER, // slot 0
+    LOG_NAME, // defines a path or method name id for the rest of the segment
+    LOG_RESPONSE,
+};
+
+enum { LOG_OTHER, LOG_GET, LOG_PUT, LOG_APPEND };
+
+typedef struct LogHeader {
+    uint8_t kind; // LOG_HEADER
+    uint8_t record_size;
+    uint16_t pad;
+    uint32_t segment; // n in <logfile>.n
+    char magic[8];
+    uint64_t created_ns; // CLOCK_REALTIME
+    uint64_t pad2;
+} LogHeader;
+
+// The name runs on past text into as many of the following slots as it needs.
+typedef struct LogName {
+    uint8_t kind; // LOG_NAME
+    uint8_t len;
+    uint16_t pad;
+    uint32_t id; // from 1, per segment
+    char text[LOG_RECORD_SIZE - 8];
+} LogName;
+
+typedef struct LogResponse {
+    uint8_t kind; // LOG_RESPONSE
+    uint8_t method; // LOG_GET/PUT/APPEND, or LOG_OTHER with the name in method_id
+    uint16_t status;
+    uint32_t path_id;
+    uint32_t method_id;
+    int32_t req_id;
+    uint64_t time_ns; // CLOCK_REALTIME when logged
+    uint32_t latency_us; // from the parsed header to the log
+    uint32_t pad;
+} LogResponse;
+
+// Slots a LOG_NAME of len bytes takes.
+#define LOG_NAME_SLOTS(len) (1 + ((len) + 7) / LOG_RECORD_SIZE)
+
+typedef struct LogConfig {
+    const char *path; // NULL: stderr (text only, never rotated)
+    log_format format;
+    // a text batch is written once it holds batch bytes or is interval_ms old
+    int interval_ms;
+    size_t batch;
+    size_t rotate_bytes; // 0: no size limit (binary: LOG_SEGMENT_SIZE)
+    int rotate_seconds; // 0: no time limit
+} LogConfig;
+
+// Start the log thread.
+void log_open(const LogConfig *config);
+void log_record(const Request *req, int status);
+// Ask the log thread to rotate; safe to call from a signal handler.
+void log_rotate(void);
+// Write out everything logged so far and stop the log thread.
+void log_close(void);
+
+#endif
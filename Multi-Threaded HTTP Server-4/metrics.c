@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "httpserver.h"
+#include "cache.h"
+#include "metrics.h"
+
+#define CACHE_LINE  64
+#define MAX_SHARDS  1024
+// Histogram buckets: exact below 8, then 8 per power of two (at most 12.5%
+// off); everything from 2^MAX_EXP ns (about 18 minutes) on shares the top one.
+#define SUB_BITS    3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_EXP     40
+#define BUCKETS     ((MAX_EXP - SUB_BITS + 1) * SUB_BUCKETS)
+
+enum { M_GET, M_PUT, M_APPEND, M_OTHER, METHODS };
+static const char *method_names[METHODS] = { "GET", "PUT", "APPEND", "other" };
+static const int statuses[] = { 200, 201, 400, 403, 404, 500, 501, 503 };
+#define STATUSES (sizeof(statuses) / sizeof(statuses[0]) + 1) // + other
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum; // ns
+    _Atomic uint64_t buckets[BUCKETS];
+} Histogram;
+
+// Written by its owner thread only, read by scrapes.
+typedef struct {
+    Histogram timers[T_COUNT];
+    _Atomic uint64_t responses[METHODS][STATUSES];
+    _Atomic bool owned;
+} Shard;
+
+static const struct {
+    const char *name;
+    const char *help;
+} timer_info[T_COUNT] = {
+    [T_QUEUE_WAIT] = { "queue_wait", "Time a connection waited in the queue for a worker (-e threads)." },
+    [T_PARSE] = { "parse", "Time spent parsing a request header." },
+    [T_DISK] = { "disk", "File system time of a request: open, stat, cache fill, sync, rename." },
+    [T_SERVICE] = { "service", "Time from a parsed request header to the request being done." },
+};
+
+static struct {
+    Shard *shards[MAX_SHARDS];
+    _Atomic int nshards;
+    pthread_mutex_t claim; // taken only when a thread records for the first time
+    pthread_key_t key; // hands a shard back when its thread exits
+    const char *name;
+    const _Atomic int *workers;
+} metrics;
+
+static __thread Shard *my_shard;
+
+static void release_shard(void *shard) {
+    atomic_store(&((Shard *) shard)->owned, false);
+}
+
+// Counts in a shard handed back by an exited thread carry on under its next owner.
+static Shard *claim_shard(void) {
+    pthread_mutex_lock(&metrics.claim);
+    int n = atomic_load(&metrics.nshards);
+    Shard *s = NULL;
+    for (int i = 0; i < n && s == NULL; i++) {
+        if (!atomic_load(&metrics.shards[i]->owned)) {
+            s = metrics.shards[i];
+        }
+    }
+    if (s == NULL) {
+        if (n == MAX_SHARDS) {
+            errx(EXIT_FAILURE, "too many metrics threads");
+        }
+        s = aligned_alloc(CACHE_LINE, (sizeof(Shard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+        if (s == NULL) {
+            err(EXIT_FAILURE, "metrics shard");
+        }
+        memset(s, 0, sizeof(Shard));
+        metrics.shards[n] = s;
+        atomic_store(&metrics.nshards, n + 1);
+    }
+    atomic_store(&s->owned, true);
+    pthread_mutex_unlock(&metrics.claim);
+
+    pthread_setspecific(metrics.key, s);
+    my_shard = s;
+    return s;
+}
+
+static Shard *shard(void) {
+    return my_shard != NULL ? my_shard : claim_shard();
+}
+
+// Single writer: a plain load and store, no locked instruction.
+static void add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    if (ns >= (uint64_t) 1 << MAX_EXP) {
+        return BUCKETS - 1;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    return (exp - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// The largest value that lands in bucket b.
+static uint64_t bucket_top(size_t b) {
+    if (b < SUB_BUCKETS) {
+        return b;
+    }
+    int shift = b / SUB_BUCKETS - 1;
+    return ((SUB_BUCKETS + b % SUB_BUCKETS + (uint64_t) 1) << shift) - 1;
+}
+
+void metrics_init(const char *name) {
+    metrics.name = name;
+    pthread_mutex_init(&metrics.claim, NULL);
+    pthread_key_create(&metrics.key, release_shard);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_time(timer t, uint64_t ns) {
+    Histogram *h = &shard()->timers[t];
+    add(&h->count, 1);
+    add(&h->sum, ns);
+    add(&h->buckets[bucket_of(ns)], 1);
+}
+
+parseResult metrics_parse(Parser *p, const char *buf, size_t len, Request *req) {
+    uint64_t begin = metrics_now();
+    parseResult rc = parse_request(p, buf, len, req);
+    uint64_t end = metrics_now();
+    req->parse_ns += end - begin;
+    if (rc == PARSE_DONE) {
+        req->start_ns = end;
+        metrics_time(T_PARSE, req->parse_ns);
+    }
+    return rc;
+}
+
+void metrics_response(const Request *req, int status) {
+    // an unparsable request has no method, whatever req->method says
+    int method = req->method_name.len == 0 ? M_OTHER
+                 : req->method == GET      ? M_GET
+                 : req->method == PUT      ? M_PUT
+                 : req->method == APPEND   ? M_APPEND
+                                           : M_OTHER;
+    size_t s = 0;
+    while (s < STATUSES - 1 && statuses[s] != status) {
+        s++;
+    }
+    add(&shard()->responses[method][s], 1);
+}
+
+void metrics_done(const Request *req) {
+    if (req->start_ns != 0) {
+        metrics_time(T_SERVICE, metrics_now() - req->start_ns);
+    }
+    if (req->disk_ns != 0) {
+        metrics_time(T_DISK, req->disk_ns);
+    }
+}
+
+void metrics_workers(const _Atomic int *live) {
+    metrics.workers = live;
+}
+
+bool metrics_request(const Request *req) {
+    return metrics.name != NULL && req->method == GET && strcmp(req->path, metrics.name) == 0;
+}
+
+static void write_timer(FILE *out, timer t) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t buckets[BUCKETS] = { 0 };
+    uint64_t count = 0, sum = 0;
+    int n = atomic_load(&metrics.nshards);
+    for (int i = 0; i < n; i++) {
+        Histogram *h = &metrics.shards[i]->timers[t];
+        count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        for (size_t b = 0; b < BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+
+    const char *name = timer_info[t].name;
+    fprintf(out, "# HELP httpserver_%s_seconds %s\n", name, timer_info[t].help);
+    fprintf(out, "# TYPE httpserver_%s_seconds summary\n", name);
+    // the counts were read one shard at a time; rank against what was read
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+    }
+    size_t b = 0;
+    uint64_t below = 0;
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t rank = (uint64_t) (quantiles[q] * seen);
+        while (b < BUCKETS - 1 && below + buckets[b] <= rank) {
+            below += buckets[b++];
+        }
+        fprintf(out, "httpserver_%s_seconds{quantile=\"%g\"} %.9f\n", name, quantiles[q],
+            seen > 0 ? bucket_top(b) / 1e9 : 0.0);
+    }
+    fprintf(out, "httpserver_%s_seconds_sum %.9f\n", name, sum / 1e9);
+    fprintf(out, "httpserver_%s_seconds_count %lu\n", name, (unsigned long) count);
+}
+
+CacheEntry *metrics_reply(void) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    fprintf(out, "# HELP httpserver_responses_total Responses by method and status.\n");
+    fprintf(out, "# TYPE httpserver_responses_total counter\n");
+    int n = atomic_load(&metrics.nshards);
+    for (int m = 0; m < METHODS; m++) {
+        for (size_t s = 0; s < STATUSES; s++) {
+            uint64_t total = 0;
+            for (int i = 0; i < n; i++) {
+                total += atomic_load_explicit(&metrics.shards[i]->responses[m][s], memory_order_relaxed);
+            }
+            if (total == 0) {
+                continue;
+            }
+            if (s < STATUSES - 1) {
+                fprintf(out, "httpserver_responses_total{method=\"%s\",status=\"%d\"} %lu\n",
+                    method_names[m], statuses[s], (unsigned long) total);
+            } else {
+                fprintf(out, "httpserver_responses_total{method=\"%s\",status=\"other\"} %lu\n",
+                    method_names[m], (unsigned long) total);
+            }
+        }
+    }
+    if (metrics.workers != NULL) {
+        fprintf(out, "# HELP httpserver_workers Worker threads running.\n");
+        fprintf(out, "# TYPE httpserver_workers gauge\n");
+        fprintf(out, "httpserver_workers %d\n", atomic_load(metrics.workers));
+    }
+    for (timer t = 0; t < T_COUNT; t++) {
+        write_timer(out, t);
+    }
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+
+    struct stat st = { .st_size = len };
+    CacheEntry *e = cache_alloc(metrics.name, &st);
+    if (e != NULL) {
+        memcpy(e->body, text, len);
+    }
+    free(text);
+    return e;
+}
@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "httpserver.h"
+#include "parser.h"
+
+// Request metrics. Every thread records into its own shard of counters and
+// log-linear (HDR-style) histograms, without atomics read-modify-writes or
+// locks; the shards are only merged when the metrics path is scraped, which
+// returns them in the Prometheus text format.
+
+typedef enum timer {
+    T_QUEUE_WAIT, // accept to dequeue (threads engine)
+    T_PARSE, // in the parser, over all the reads a header took
+    T_DISK, // open/stat/read-into-cache/fsync/rename of one request
+    T_SERVICE, // parsed header to done
+    T_COUNT,
+} timer;
+
+// name: the GET path (as check_format() leaves it, no '/') that serves the
+// metrics instead of a file; NULL turns that off. Recording is always on.
+void metrics_init(const char *name);
+
+uint64_t metrics_now(void); // CLOCK_MONOTONIC, ns
+void metrics_time(timer t, uint64_t ns);
+
+// parse_request(), timed into req->parse_ns. Once the header is complete it
+// records T_PARSE and starts the request's clock (req->start_ns).
+parseResult metrics_parse(Parser *p, const char *buf, size_t len, Request *req);
+// Count a response by method and status (from log_response()).
+void metrics_response(const Request *req, int status);
+// The request is done: record T_SERVICE and T_DISK.
+void metrics_done(const Request *req);
+
+// Report *live as the httpserver_workers gauge.
+void metrics_workers(const _Atomic int *live);
+
+// Whether req asks for the metrics.
+bool metrics_request(const Request *req);
+// The metrics as a complete 200 response in an unpublished cache entry (see
+// cache.h), sent like a cache hit and released after; NULL on failure.
+struct CacheEntry *metrics_reply(void);
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+
+// Header lookup: a perfect hash over the header names we know about.
+// Adding a header means checking the new name does not collide.
+#define HEADER_TABLE 16
+#define LOWER(c)     ((c) | 0x20)
+#define HEADER_HASH(name, len)                                                                     \
+    (((len) *2 + LOWER((name)[0]) * 3 + LOWER((name)[(len) -1])) & (HEADER_TABLE - 1))
+
+typedef struct {
+    const char *name;
+    size_t len;
+    key type;
+} Header;
+
+#define HEADER(s, k) { s, sizeof(s) - 1, k }
+
+// index = HEADER_HASH(name)
+static const Header headers[HEADER_TABLE] = {
+    [3] = HEADER("Accept", ACCEPT),
+    [4] = HEADER("Host", HOST),
+    [6] = HEADER("Content-Type", CONTENT_TYPE),
+    [7] = HEADER("User-Agent", USER_AGENT),
+    [11] = HEADER("Connection", CONNECTION),
+    [13] = HEADER("Content-Length", CONTENT_LENGTH),
+    [14] = HEADER("Request-Id", REQUEST_ID),
+    [15] = HEADER("Expect", EXPECT),
+};
+
+static int lookup_header(const char *name, size_t len) {
+    const Header *h = &headers[HEADER_HASH(name, len)];
+    if (h->name != NULL && h->len == len && strncasecmp(h->name, name, len) == 0) {
+        return h->type;
+    }
+    return -1;
+}
+
+static int lookup_method(Slice m) {
+    if (m.len == 3 && memcmp(m.ptr, "GET", 3) == 0) {
+        return GET;
+    }
+    if (m.len == 3 && memcmp(m.ptr, "PUT", 3) == 0) {
+        return PUT;
+    }
+    if (m.len == 6 && memcmp(m.ptr, "APPEND", 6) == 0) {
+        return APPEND;
+    }
+    return TOTAL; // valid token, method we do not implement (501)
+}
+
+// Decimal digits only; false on anything else or overflow.
+static bool parse_number(Slice s, unsigned long *out) {
+    unsigned long n = 0;
+    if (s.len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < s.len; i++) {
+        if (s.ptr[i] < '0' || s.ptr[i] > '9' || n > (~0UL - 9) / 10) {
+            return false;
+        }
+        n = n * 10 + (s.ptr[i] - '0');
+    }
+    *out = n;
+    return true;
+}
+
+// Split off the next space-delimited word of line.
+static Slice next_word(Slice *line) {
+    Slice word = { line->ptr, 0 };
+    while (word.len < line->len && line->ptr[word.len] != ' ') {
+        word.len++;
+    }
+    line->ptr += word.len;
+    line->len -= word.len;
+    if (line->len > 0) { // skip the separator
+        line->ptr++;
+        line->len--;
+    }
+    return word;
+}
+
+// METHOD SP request-target SP HTTP-version
+// space is the offset of the first ' ' in line, found by the scanner.
+static bool parse_request_line(Slice line, size_t space, Request *req) {
+    if (space == SCAN_NONE) {
+        return false;
+    }
+    Slice method = { line.ptr, space };
+    line.ptr += space + 1;
+    line.len -= space + 1;
+    Slice target = next_word(&line);
+    Slice version = next_word(&line);
+    if (method.len == 0 || target.len == 0 || version.len == 0 || line.len != 0) {
+        return false;
+    }
+    if (target.len >= sizeof(req->path)) {
+        return false;
+    }
+    req->method_name = method;
+    req->method = lookup_method(method);
+    memcpy(req->path, target.ptr, target.len);
+    req->path[target.len] = '\0';
+    req->version = version;
+    return true;
+}
+
+// field-name ":" OWS field-value OWS
+// colon is the offset of the first ':' in line, found by the scanner.
+static bool parse_header(Parser *p, Slice line, size_t colon, Request *req) {
+    if (colon == SCAN_NONE || colon == 0) {
+        return false;
+    }
+    size_t name_len = colon;
+    if (memchr(line.ptr, ' ', name_len) != NULL) {
+        return false;
+    }
+
+    Slice value = { line.ptr + colon + 1, line.len - name_len - 1 };
+    while (value.len > 0 && (value.ptr[0] == ' ' || value.ptr[0] == '\t')) {
+        value.ptr++;
+        value.len--;
+    }
+    while (value.len > 0 && (value.ptr[value.len - 1] == ' ' || value.ptr[value.len - 1] == '\t')) {
+        value.len--;
+    }
+
+    unsigned long n = 0;
+    switch (lookup_header(line.ptr, name_len)) {
+    case CONTENT_LENGTH:
+        // A repeated Content-Length must agree with the first (RFC 9112 6.3):
+        // a proxy in front that framed the body by the other one would take
+        // the rest of it for a request of its own.
+        if (!parse_number(value, &n) || (p->has_length && n != req->cnt_len)) {
+            return false;
+        }
+        req->cnt_len = n;
+        p->has_length = true;
+        break;
+    case REQUEST_ID:
+        // like atoi(): a malformed id is logged as 0
+        req->req_id = parse_number(value, &n) ? (int) n : 0;
+        break;
+    case CONNECTION:
+        if (value.len == 5 && strncasecmp(value.ptr, "close", 5) == 0) {
+            req->conn_close = true;
+        }
+        break;
+    default: // Host, User-Agent, ... and headers we do not know are ignored
+        break;
+    }
+    return true;
+}
+
+void parser_init(Parser *p) {
+    memset(p, 0, sizeof(*p));
+    p->delim = SCAN_NONE;
+    p->request_line = true;
+}
+
+parseResult parse_request(Parser *p, const char *buf, size_t len, Request *req) {
+    for (;;) {
+        // one pass finds both the end of the line and its first delimiter
+        size_t found = p->delim == SCAN_NONE ? SCAN_NONE : 0;
+        size_t eol = scan_line(buf + p->scan, len - p->scan, p->request_line ? ' ' : ':', &found);
+        if (p->delim == SCAN_NONE && found != SCAN_NONE) {
+            p->delim = p->scan + found;
+        }
+        if (p->scan + eol == len) {
+            p->scan = len; // resume here once more bytes arrive
+            return PARSE_AGAIN;
+        }
+
+        size_t nl = p->scan + eol;
+        Slice line = { buf + p->line, nl - p->line };
+        if (line.len > 0 && line.ptr[line.len - 1] == '\r') {
+            line.len--;
+        }
+        size_t delim = p->delim == SCAN_NONE ? SCAN_NONE : p->delim - p->line;
+        p->line = p->scan = nl + 1;
+        p->delim = SCAN_NONE;
+
+        if (p->request_line) {
+            if (!parse_request_line(line, delim, req)) {
+                return PARSE_ERROR;
+            }
+            p->request_line = false;
+        } else if (line.len == 0) { // blank line: end of header
+            req->hdr_len = p->line;
+            req->msg_bdy = (char *) buf + req->hdr_len;
+            req->bdy_len = len - req->hdr_len;
+            return PARSE_DONE;
+        } else if (!parse_header(p, line, delim, req)) {
+            return PARSE_ERROR;
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include "httpserver.h"
+#include "scan.h"
+
+typedef enum parseResult {
+    PARSE_ERROR = -1, // malformed request: reply 400
+    PARSE_AGAIN = 0, // header not complete yet: read more and call again
+    PARSE_DONE = 1, // header complete, req is filled in
+} parseResult;
+
+// Resumable request-header parser. It works in place on the caller's buffer:
+// slices in the Request point into it, so the buffer must stay put (it may
+// only grow at the end) until the request has been served.
+typedef struct Parser {
+    size_t line; // start of the line being parsed
+    size_t scan; // how far the buffer has been searched for the end of that line
+    size_t delim; // first ' ' (request line) or ':' (header) of that line, or SCAN_NONE
+    bool request_line; // still waiting for the request line
+    bool has_length; // a Content-Length header was seen
+} Parser;
+
+void parser_init(Parser *p);
+// Parse whatever of buf[0..len) has not been parsed yet.
+parseResult parse_request(Parser *p, const char *buf, size_t len, Request *req);
+
+#endif
@@ -1,77 +1,395 @@
-#include <sys/queue.h>
-#include <pthread.h>
-#include <semaphore.h>
-#include <fcntl.h>
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <err.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "queue.h"
-// creating semaphore:
-// http://www.eventorient.com/2017/07/semaphores-in-mac-os-x-seminit-is.html
-// tail queue:
-// https://ofstack.com/C++/9343/c-language-tail-queue-tailq-is-shared-using-examples.html
-TAILQ_HEAD(tailhead, connNode) head = TAILQ_HEAD_INITIALIZER(head);
+// bounded MPMC queue:
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// futex:
+// https://man7.org/linux/man-pages/man2/futex.2.html
 
-struct connNode {
+#define CACHE_LINE 64
+
+// One slot per cache line so producers and consumers working on
+// neighbouring slots do not false-share.
+typedef struct {
+    _Atomic size_t seq;
     int connfd;
-    TAILQ_ENTRY(connNode) entries;
-};
+    uint64_t enqueued; // CLOCK_MONOTONIC ns, for dequeueTimed()
+    char pad[CACHE_LINE - 2 * sizeof(uint64_t) - sizeof(size_t)];
+} Slot;
+
+// Eventcount: sleepers announce themselves in waiters, then read seq and
+// recheck; wakers only bump seq and make the futex syscall when somebody is
+// actually asleep, so an uncontended signal writes no shared cache line.
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+} Event;
 
-typedef sem_t Semaphore;
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic size_t head; // next slot to dequeue
+    _Alignas(CACHE_LINE) _Atomic size_t tail; // next slot to enqueue
+    _Alignas(CACHE_LINE) Slot *slots;
+    size_t size; // number of slots
+    size_t capacity; // size, except a one-entry ring still needs two slots
+    Event not_empty; // its owner sleeps here (every worker, with one ring)
+    _Atomic size_t steals; // connections taken from other rings by this ring's owner
+    _Atomic int owners; // running workers whose home ring this is
+} Ring;
 
-// Semaphores
-Semaphore *sem;
-Semaphore *lock;
+static struct {
+    Ring *rings;
+    size_t nrings;
+    _Atomic size_t next; // turn of the next connection, round-robin
+    _Atomic int owned; // rings with an owner
+    _Alignas(CACHE_LINE) _Atomic int idle; // workers asleep in dequeueTimed()
+    Event not_full;
+    atomic_bool closed;
+} queue;
 
-static Semaphore *make_semaphore(int value) {
-    Semaphore *semaphore = (Semaphore *) malloc(sizeof(Semaphore));
-    semaphore = sem_open("/semaphore", O_CREAT, 0644, value);
-    if (semaphore == SEM_FAILED) {
-        errx(EXIT_FAILURE, "Failed to open semphore for empty");
+// timeout_ns: 0 waits until woken
+static void event_wait(Event *ev, uint32_t seen, uint64_t timeout_ns) {
+    struct timespec ts = { .tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000 };
+    syscall(SYS_futex, (uint32_t *) &ev->seq, FUTEX_WAIT_PRIVATE, seen, timeout_ns ? &ts : NULL,
+        NULL, 0);
+}
+
+// Call after making the condition true. Returns whether anybody was waiting.
+static bool event_signal(Event *ev) {
+    atomic_thread_fence(memory_order_seq_cst); // the condition before waiters
+    if (atomic_load(&ev->waiters) == 0) {
+        return false;
     }
-    sem_unlink("/semaphore");
-    return semaphore;
+    atomic_fetch_add(&ev->seq, 1);
+    syscall(SYS_futex, (uint32_t *) &ev->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    return true;
 }
 
-static void semaphore_wait(Semaphore *semaphore) {
-    sem_wait(semaphore);
+// Wake every sleeper, whether or not its condition holds.
+static void event_broadcast(Event *ev) {
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_fetch_add(&ev->seq, 1);
+    syscall(SYS_futex, (uint32_t *) &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
-static void semaphore_signal(Semaphore *semaphore) {
-    sem_post(semaphore);
+// Announce a sleeper; the caller rechecks its condition before event_wait().
+static uint32_t event_prepare(Event *ev) {
+    atomic_fetch_add(&ev->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst); // waiters before the recheck
+    return atomic_load(&ev->seq);
 }
 
-void createQueue(void) {
-    sem = make_semaphore(0);
-    lock = make_semaphore(1);
-    TAILQ_INIT(&head);
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void enqueue(int connfd) {
+static bool ring_push(Ring *ring, int connfd, uint64_t now) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        Slot *slot = &ring->slots[pos % ring->size];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (ring->capacity < ring->size && pos - atomic_load(&ring->head) >= ring->capacity) {
+                return false;
+            }
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                slot->connfd = connfd;
+                slot->enqueued = now;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) { // full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
 
-    semaphore_wait(lock);
+static bool ring_pop(Ring *ring, int *connfd, uint64_t *enqueued) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        Slot *slot = &ring->slots[pos % ring->size];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *connfd = slot->connfd;
+                *enqueued = slot->enqueued;
+                atomic_store_explicit(&slot->seq, pos + ring->size, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) { // empty
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
 
-    {
-        struct connNode *node = (struct connNode *) malloc(sizeof(struct connNode));
-        node->connfd = connfd;
-        TAILQ_INSERT_TAIL(&head, node, entries);
+static bool owned(size_t r) {
+    return atomic_load_explicit(&queue.rings[r].owners, memory_order_relaxed) > 0;
+}
+
+// The ring to try first: the next in turn among those a running worker calls
+// home (with -t min:max most -s steal rings may have none), or the only one.
+static size_t first_ring(void) {
+    if (queue.nrings == 1) {
+        return 0;
     }
+    size_t turn = atomic_fetch_add_explicit(&queue.next, 1, memory_order_relaxed);
+    int n = atomic_load_explicit(&queue.owned, memory_order_relaxed);
+    if (n > 0) {
+        size_t k = turn % n;
+        for (size_t r = 0; r < queue.nrings; r++) {
+            if (owned(r) && k-- == 0) {
+                return r;
+            }
+        }
+    }
+    return turn % queue.nrings; // no worker yet, or one just came or went
+}
 
-    semaphore_signal(lock);
-    semaphore_signal(sem);
+// Push into the next ring in turn, or the first owned one after it with room;
+// a ring nobody calls home only takes what the others have no room for (or
+// anything before the first worker joins), and is left to thieves.
+// Returns the ring used, -1 when every ring is full.
+static long push_any(int connfd, uint64_t now) {
+    size_t first = first_ring();
+    bool any = atomic_load_explicit(&queue.owned, memory_order_relaxed) == 0;
+    for (int pass = any ? 1 : 0; pass < 2; pass++) {
+        for (size_t i = 0; i < queue.nrings; i++) {
+            size_t r = (first + i) % queue.nrings;
+            if ((pass == 1 || owned(r)) && ring_push(&queue.rings[r], connfd, now)) {
+                return r;
+            }
+        }
+    }
+    return -1;
 }
 
-int dequeue(void) {
-    int n = -1;
-    semaphore_wait(sem);
-    semaphore_wait(lock);
+// Pop from the worker's own ring, else steal from the others, starting with
+// its neighbour so that thieves spread over the victims.
+static bool pop_any(int worker, int *connfd, uint64_t *enqueued) {
+    size_t home = worker % queue.nrings;
+    if (ring_pop(&queue.rings[home], connfd, enqueued)) {
+        return true;
+    }
+    for (size_t i = 1; i < queue.nrings; i++) {
+        if (ring_pop(&queue.rings[(home + i) % queue.nrings], connfd, enqueued)) {
+            atomic_fetch_add_explicit(&queue.rings[home].steals, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A connection landed in ring r: wake its owner, or if the owner is busy
+// serving, any idle worker to steal it.
+static void wake(size_t r) {
+    if (event_signal(&queue.rings[r].not_empty) || queue.nrings == 1
+        || atomic_load(&queue.idle) == 0) {
+        return;
+    }
+    for (size_t i = 1; i < queue.nrings; i++) {
+        if (event_signal(&queue.rings[(r + i) % queue.nrings].not_empty)) {
+            return;
+        }
+    }
+}
+
+void createQueue(int capacity, int rings) {
+    if (capacity <= 0 || capacity > INT_MAX / 2) {
+        errx(EXIT_FAILURE, "bad queue capacity: %d", capacity);
+    }
+    if (rings <= 0) {
+        errx(EXIT_FAILURE, "bad number of queue rings: %d", rings);
+    }
+
+    queue.rings = aligned_alloc(CACHE_LINE, rings * sizeof(Ring));
+    if (queue.rings == NULL) {
+        errx(EXIT_FAILURE, "Failed to allocate queue");
+    }
+    memset(queue.rings, 0, rings * sizeof(Ring));
+    // the capacity is split evenly, rounding up
+    size_t per_ring = (capacity + rings - 1) / rings;
+    for (int r = 0; r < rings; r++) {
+        Ring *ring = &queue.rings[r];
+        size_t size = per_ring < 2 ? 2 : per_ring;
+        ring->slots = aligned_alloc(CACHE_LINE, size * sizeof(Slot));
+        if (ring->slots == NULL) {
+            errx(EXIT_FAILURE, "Failed to allocate queue");
+        }
+        for (size_t i = 0; i < size; i++) {
+            atomic_init(&ring->slots[i].seq, i);
+        }
+        ring->size = size;
+        ring->capacity = per_ring;
+    }
+    queue.nrings = rings;
+}
+
+void destroyQueue(void) {
+    for (size_t r = 0; r < queue.nrings; r++) {
+        free(queue.rings[r].slots);
+    }
+    free(queue.rings);
+    memset(&queue, 0, sizeof(queue));
+}
+
+void queueJoin(int worker) {
+    if (atomic_fetch_add(&queue.rings[worker % queue.nrings].owners, 1) == 0) {
+        atomic_fetch_add(&queue.owned, 1);
+    }
+}
 
-    {
-        struct connNode *node = TAILQ_FIRST(&head);
-        n = node->connfd;
-        TAILQ_REMOVE(&head, node, entries); /* Deletion. */
-        free(node);
+void queueLeave(int worker) {
+    size_t home = worker % queue.nrings;
+    if (atomic_fetch_sub(&queue.rings[home].owners, 1) == 1) {
+        atomic_fetch_sub(&queue.owned, 1);
+        // whatever was pushed before it stopped counting is for a thief now
+        if (atomic_load(&queue.rings[home].tail) != atomic_load(&queue.rings[home].head)) {
+            wake(home);
+        }
     }
+}
 
-    semaphore_signal(lock);
+bool tryEnqueue(int connfd) {
+    long r = push_any(connfd, now_ns());
+    if (r < 0) {
+        return false;
+    }
+    wake(r);
+    return true;
+}
 
+bool tryDequeue(int *connfd) {
+    uint64_t enqueued;
+    // about where the next connection would go, which is full if all are
+    size_t first = atomic_load_explicit(&queue.next, memory_order_relaxed);
+    for (size_t i = 0; i < queue.nrings; i++) {
+        if (ring_pop(&queue.rings[(first + i) % queue.nrings], connfd, &enqueued)) {
+            event_signal(&queue.not_full);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t queueDepth(void) {
+    size_t depth = 0;
+    for (size_t r = 0; r < queue.nrings; r++) {
+        size_t tail = atomic_load(&queue.rings[r].tail);
+        size_t head = atomic_load(&queue.rings[r].head);
+        depth += tail > head ? tail - head : 0;
+    }
+    return depth;
+}
+
+size_t queueSteals(void) {
+    size_t steals = 0;
+    for (size_t r = 0; r < queue.nrings; r++) {
+        steals += atomic_load_explicit(&queue.rings[r].steals, memory_order_relaxed);
+    }
+    return steals;
+}
+
+int queueIdle(void) {
+    return atomic_load(&queue.idle);
+}
+
+void queueClose(void) {
+    atomic_store(&queue.closed, true);
+    for (size_t r = 0; r < queue.nrings; r++) {
+        event_broadcast(&queue.rings[r].not_empty);
+    }
+}
+
+bool queueClosed(void) {
+    return atomic_load(&queue.closed);
+}
+
+void enqueue(int connfd) {
+    uint64_t now = now_ns();
+    for (;;) {
+        long r = push_any(connfd, now);
+        if (r < 0) {
+            uint32_t seen = event_prepare(&queue.not_full);
+            if ((r = push_any(connfd, now)) < 0) {
+                event_wait(&queue.not_full, seen, 0);
+            }
+            atomic_fetch_sub(&queue.not_full.waiters, 1);
+        }
+        if (r >= 0) {
+            wake(r);
+            return;
+        }
+    }
+}
+
+int dequeue(int worker) {
+    uint64_t waited;
+    return dequeueTimed(worker, &waited);
+}
+
+int dequeueTimed(int worker, uint64_t *waited_ns) {
+    return dequeueWithin(worker, 0, waited_ns);
+}
+
+int dequeueWithin(int worker, uint64_t timeout_ns, uint64_t *waited_ns) {
+    size_t home = worker % queue.nrings;
+    Event *ev = &queue.rings[home].not_empty;
+    uint64_t deadline = timeout_ns > 0 ? now_ns() + timeout_ns : 0;
+    int n = -1;
+    uint64_t enqueued;
+    bool got = pop_any(worker, &n, &enqueued);
+    bool slept = false;
+    while (!got) {
+        uint64_t now = deadline != 0 ? now_ns() : 0;
+        if (deadline != 0 && now >= deadline) {
+            break;
+        }
+        atomic_fetch_add(&queue.idle, 1);
+        uint32_t seen = event_prepare(ev);
+        // closed is read after registering, so queueClose() wakes us if we miss it
+        bool closed = atomic_load(&queue.closed);
+        if (!(got = pop_any(worker, &n, &enqueued)) && !closed) {
+            event_wait(ev, seen, deadline != 0 ? deadline - now : 0);
+        }
+        atomic_fetch_sub(&ev->waiters, 1);
+        atomic_fetch_sub(&queue.idle, 1);
+        atomic_thread_fence(memory_order_seq_cst); // deregistered before the pop
+        slept = true;
+        if (!got) {
+            got = pop_any(worker, &n, &enqueued);
+        }
+        if (!got && closed) {
+            break;
+        }
+    }
+    // A push into this ring while we were registered signalled only us; we are
+    // leaving (busy or timed out), so hand that wakeup on to an idle thief.
+    if (slept && queue.nrings > 1
+        && atomic_load(&queue.rings[home].tail) != atomic_load(&queue.rings[home].head)) {
+        wake(home);
+    }
+    if (!got) {
+        return -1;
+    }
+    event_signal(&queue.not_full);
+    *waited_ns = now_ns() - enqueued;
     return n;
 }
@@ -1,6 +1,37 @@
 #include <stdlib.h>
+#include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
 
-void createQueue(void);
+// holds at most capacity connections, split over rings per-worker rings;
+// rings = 1 is one ring every worker takes from
+void createQueue(int capacity, int rings);
+// frees the rings once no thread uses the queue any more; createQueue() may follow
+void destroyQueue(void);
+// blocks while the queue is full; connections go round-robin to the rings of
+// running workers (see queueJoin()), to the others only when those are full
 void enqueue(int connfd);
-int dequeue(void);
+// blocks while the queue is empty; worker takes from its own ring
+// (worker % rings) first and steals from the others when that is empty
+int dequeue(int worker);
+// dequeue(), also reporting how long the connection sat in the queue
+int dequeueTimed(int worker, uint64_t *waited_ns);
+// dequeueTimed() that gives up after timeout_ns (0: never) and returns -1
+int dequeueWithin(int worker, uint64_t timeout_ns, uint64_t *waited_ns);
+// worker starts or stops taking connections from its ring (worker % rings);
+// until some worker has joined, enqueue() uses every ring
+void queueJoin(int worker);
+void queueLeave(int worker);
+// no more connections are coming: once the queue is empty, dequeue*() return
+// -1 instead of blocking, and the workers asleep in them wake up
+void queueClose(void);
+bool queueClosed(void);
+// non-blocking variants; return false when the queue is full/empty
+bool tryEnqueue(int connfd);
+bool tryDequeue(int *connfd);
+// number of connections currently waiting (approximate under concurrency)
+size_t queueDepth(void);
+// connections a worker took from another worker's ring so far
+size_t queueSteals(void);
+// workers asleep waiting for a connection
+int queueIdle(void);
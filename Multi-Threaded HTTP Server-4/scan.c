@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// Structural-character scanning: compare 16 (SSE2) or 32 (AVX2) bytes at a
+// time against '\n' and the delimiter and turn the results into bitmasks.
+// https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+
+// Every kernel scans buf[i..len) and reports offsets from buf.
+typedef size_t (*scanFn)(const char *buf, size_t i, size_t len, char delim, size_t *delim_at);
+
+static size_t scan_scalar(const char *buf, size_t i, size_t len, char delim, size_t *delim_at) {
+    for (; i < len; i++) {
+        if (buf[i] == '\n') {
+            return i;
+        }
+        if (buf[i] == delim && *delim_at == SCAN_NONE) {
+            *delim_at = i;
+        }
+    }
+    return len;
+}
+
+// One block's worth of masks: bit k set when byte k matched.
+static size_t scan_masks(size_t i, uint32_t nl, uint32_t dm, size_t *delim_at, bool *found) {
+    if (nl != 0) {
+        unsigned k = __builtin_ctz(nl);
+        dm &= (1u << k) - 1; // only delimiters before the newline count
+        if (dm != 0 && *delim_at == SCAN_NONE) {
+            *delim_at = i + __builtin_ctz(dm);
+        }
+        *found = true;
+        return i + k;
+    }
+    if (dm != 0 && *delim_at == SCAN_NONE) {
+        *delim_at = i + __builtin_ctz(dm);
+    }
+    *found = false;
+    return 0;
+}
+
+#ifdef SCAN_X86
+static size_t scan_sse2(const char *buf, size_t i, size_t len, char delim, size_t *delim_at) {
+    const __m128i vnl = _mm_set1_epi8('\n');
+    const __m128i vdelim = _mm_set1_epi8(delim);
+    bool found;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        uint32_t nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl));
+        uint32_t dm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vdelim));
+        size_t at = scan_masks(i, nl, dm, delim_at, &found);
+        if (found) {
+            return at;
+        }
+    }
+    return scan_scalar(buf, i, len, delim, delim_at);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(
+    const char *buf, size_t i, size_t len, char delim, size_t *delim_at) {
+    const __m256i vnl = _mm256_set1_epi8('\n');
+    const __m256i vdelim = _mm256_set1_epi8(delim);
+    bool found;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        uint32_t nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vnl));
+        uint32_t dm = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vdelim));
+        size_t at = scan_masks(i, nl, dm, delim_at, &found);
+        if (found) {
+            return at;
+        }
+    }
+    // The tail stays in this function: calling the non-VEX SSE2 kernel from
+    // here would pay the AVX/SSE transition penalty.
+    if (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        uint32_t nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(vnl)));
+        uint32_t dm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(vdelim)));
+        size_t at = scan_masks(i, nl, dm, delim_at, &found);
+        if (found) {
+            return at;
+        }
+        i += 16;
+    }
+    for (; i < len; i++) {
+        if (buf[i] == '\n') {
+            return i;
+        }
+        if (buf[i] == delim && *delim_at == SCAN_NONE) {
+            *delim_at = i;
+        }
+    }
+    return len;
+}
+#endif
+
+static scanFn scan_impl;
+
+bool scan_select(const char *impl) {
+    scanFn fn = NULL;
+    if (strcmp(impl, "scalar") == 0) {
+        fn = scan_scalar;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(impl, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        fn = scan_sse2;
+    }
+    if (strcmp(impl, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        fn = scan_avx2;
+    }
+#endif
+    if (fn == NULL) {
+        return false;
+    }
+    __atomic_store_n(&scan_impl, fn, __ATOMIC_RELAXED);
+    return true;
+}
+
+size_t scan_line(const char *buf, size_t len, char delim, size_t *delim_at) {
+    scanFn fn = __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+    if (fn == NULL) { // first call: pick the widest implementation available
+        if (!scan_select("avx2") && !scan_select("sse2")) {
+            scan_select("scalar");
+        }
+        fn = __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+    }
+    return fn(buf, 0, len, delim, delim_at);
+}
@@ -0,0 +1,18 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SCAN_NONE ((size_t) -1)
+
+// Find the first '\n' in buf[0..len) and return its offset (len if there is none).
+// In the same pass, if *delim_at is SCAN_NONE and delim occurs before that
+// point, *delim_at is set to the offset of its first occurrence.
+// Uses AVX2 or SSE2 when the CPU has them (checked once at run time).
+size_t scan_line(const char *buf, size_t len, char delim, size_t *delim_at);
+
+// Force an implementation: "scalar", "sse2" or "avx2". False if unsupported.
+bool scan_select(const char *impl);
+
+#endif
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Run a fixed set of request mixes against one engine and print loadgen's
+# throughput and latency percentiles for each.
+#
+# usage: tools/bench.sh [port] [engine] [threads] [loadgen options...]
+PORT=${1:-8080}
+ENGINE=${2:-threads}
+THREADS=${3:-4}
+if [ $# -ge 3 ]; then shift 3; else shift $#; fi
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+trap 'kill "$pid" 2>/dev/null; rm -rf "$DIR"' EXIT
+
+cd "$DIR" || exit 1
+"$ROOT/httpserver" -t "$THREADS" -e "$ENGINE" -l /dev/null "$PORT" &
+pid=$!
+sleep 0.5
+run() {
+    name=$1
+    shift
+    printf '%s\n  ' "$name"
+    "$ROOT/loadgen" "$@" "$PORT" obj
+}
+run "GET 4K, new connection per request" -c 8 -n 2000 -f 64 -s 4096 "$@"
+run "GET 4K, keep-alive" -c 8 -n 5000 -k -f 64 -s 4096 "$@"
+run "GET 4K, pipelined 16 deep" -c 8 -n 5000 -p 16 -f 64 -s 4096 "$@"
+run "GET 1M, keep-alive" -c 4 -n 200 -k -f 16 -s 1048576 "$@"
+run "PUT 64K, keep-alive" -c 8 -n 1000 -k -m 0:1:0 -f 64 -s 65536 "$@"
+run "APPEND 512, keep-alive" -c 8 -n 2000 -k -m 0:0:1 -f 64 -s 512 "$@"
+run "mixed 80:15:5, 1K-16K, keep-alive" -c 8 -n 3000 -k -m 80:15:5 -f 64 -s 1024:16384 "$@"
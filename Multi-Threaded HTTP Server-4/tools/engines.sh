@@ -0,0 +1,24 @@
+#!/bin/sh
+# Compare the connection engines (-e threads|epoll|uring) under the same load.
+#
+# usage: tools/engines.sh [port] [threads] [file-size] [loadgen options...]
+PORT=${1:-8080}
+THREADS=${2:-4}
+SIZE=${3:-4096}
+if [ $# -ge 3 ]; then shift 3; else shift $#; fi
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c "$SIZE" /dev/urandom > "$DIR/bench.bin"
+cd "$DIR" || exit 1
+for engine in threads epoll uring; do
+    "$ROOT/httpserver" -t "$THREADS" -e "$engine" -l /dev/null "$PORT" &
+    pid=$!
+    sleep 0.5
+    printf '%-8s ' "$engine"
+    "$ROOT/loadgen" "$@" "$PORT" bench.bin
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    PORT=$((PORT + 1))
+done
@@ -0,0 +1,359 @@
+// Load generator: concurrent clients issuing a mix of GET/PUT/APPEND requests
+// against a local httpserver, reporting throughput and latency percentiles.
+//
+// usage: loadgen [-c clients] [-n requests-per-client] [-k] [-p depth]
+//                [-m get:put:append] [-s size|min:max] [-f files] <port> <path>
+//   -k: keep-alive, send every request of a client on one connection
+//   -p: pipelining depth, requests sent back to back before reading their
+//       responses (implies -k; default 1)
+//   -m: relative weights of GET, PUT and APPEND (default 1:0:0)
+//   -s: PUT/APPEND body size in bytes, fixed or uniform in [min, max]
+//       (default 4096); with -f also the size of the files prepared for GET
+//   -f: spread the requests over <path>0 .. <path>N-1, PUT before the clock
+//       starts (default: use <path> itself, which GET needs to exist)
+#include <arpa/inet.h>
+#include <err.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS          "c:n:kp:m:s:f:"
+#define BUF_SIZE         (64 * 1024)
+#define DEFAULT_CLIENTS  4
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_SIZE     4096
+#define MAX_DEPTH        256
+
+enum { GET, PUT, APPEND, METHODS };
+static const char *method_names[METHODS] = { "GET", "PUT", "APPEND" };
+
+static uint16_t port;
+static const char *path;
+static int requests = DEFAULT_REQUESTS;
+static int keep_alive;
+static int depth = 1;
+static int weights[METHODS] = { 1, 0, 0 };
+static long min_size = DEFAULT_SIZE, max_size = DEFAULT_SIZE;
+static int files;
+static char *payload; // max_size bytes every PUT/APPEND body is cut from
+
+typedef struct {
+    int id;
+    long done;
+    long errors;
+    long bytes; // body bytes sent and received
+    long by_method[METHODS];
+    uint64_t *latency; // ns, one per completed request
+} Result;
+
+// A connection and the response bytes read from it but not consumed yet.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    int closing; // the last response said Connection: close
+} Conn;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void target(char *name, size_t size, unsigned *seed) {
+    if (files > 0) {
+        snprintf(name, size, "%s%d", path, (int) (rand_r(seed) % files));
+    } else {
+        snprintf(name, size, "%s", path);
+    }
+}
+
+static long body_size(unsigned *seed) {
+    return min_size + (max_size > min_size ? rand_r(seed) % (max_size - min_size + 1) : 0);
+}
+
+static int send_request(int fd, int method, const char *name, long size, int id) {
+    char head[256];
+    int len = method == GET
+                  ? snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\nRequest-Id: %d\r\n\r\n", name, id)
+                  : snprintf(head, sizeof(head),
+                      "%s /%s HTTP/1.1\r\nRequest-Id: %d\r\nContent-Length: %ld\r\n\r\n",
+                      method_names[method], name, id, size);
+    if (write_all(fd, head, len) < 0) {
+        return -1;
+    }
+    return method == GET ? 0 : write_all(fd, payload, size);
+}
+
+// Read one response, leaving whatever follows it (the next pipelined response)
+// in the buffer. Returns the body length on a 2xx, -1 otherwise.
+static long read_response(Conn *c) {
+    char *end;
+    for (;;) {
+        c->buf[c->len] = '\0';
+        if ((end = strstr(c->buf, "\r\n\r\n")) != NULL) {
+            break;
+        }
+        if (c->len == BUF_SIZE - 1) {
+            return -1;
+        }
+        ssize_t n = read(c->fd, c->buf + c->len, BUF_SIZE - 1 - c->len);
+        if (n <= 0) {
+            return -1;
+        }
+        c->len += n;
+    }
+    int ok = strncmp(c->buf, "HTTP/1.1 2", 10) == 0;
+    char *close_hdr = strstr(c->buf, "Connection: close");
+    c->closing = close_hdr != NULL && close_hdr < end;
+    char *cl = strstr(c->buf, "Content-Length:");
+    long body = cl != NULL && cl < end ? strtol(cl + 15, NULL, 10) : 0;
+
+    // drop the header and body, reading the part of the body not here yet
+    size_t head = end + 4 - c->buf;
+    size_t here = c->len - head < (size_t) body ? c->len - head : (size_t) body;
+    memmove(c->buf, c->buf + head + here, c->len - head - here);
+    c->len -= head + here;
+    for (long left = body - here; left > 0;) {
+        ssize_t n = read(c->fd, c->buf, left < BUF_SIZE - 1 ? left : BUF_SIZE - 1);
+        if (n <= 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    return ok ? body : -1;
+}
+
+static int pick_method(unsigned *seed) {
+    int total = weights[GET] + weights[PUT] + weights[APPEND];
+    int r = rand_r(seed) % total;
+    for (int m = 0; m < METHODS; m++) {
+        if (r < weights[m]) {
+            return m;
+        }
+        r -= weights[m];
+    }
+    return GET;
+}
+
+static void *client(void *arg) {
+    Result *res = arg;
+    unsigned seed = res->id * 7919 + 1;
+    Conn c = { .fd = -1, .buf = malloc(BUF_SIZE) };
+    int methods[MAX_DEPTH];
+    long sizes[MAX_DEPTH];
+    for (int i = 0; i < requests;) {
+        int batch = requests - i < depth ? requests - i : depth;
+        if (c.fd < 0) {
+            if ((c.fd = connect_server()) < 0) {
+                res->errors += batch;
+                i += batch;
+                continue;
+            }
+            c.len = 0;
+            c.closing = 0;
+        }
+
+        uint64_t start = now_ns();
+        int sent = 0;
+        for (; sent < batch; sent++) {
+            char name[64];
+            target(name, sizeof(name), &seed);
+            methods[sent] = pick_method(&seed);
+            sizes[sent] = methods[sent] == GET ? 0 : body_size(&seed);
+            if (send_request(c.fd, methods[sent], name, sizes[sent], res->id * requests + i + sent) < 0) {
+                break;
+            }
+        }
+        int failed = sent < batch;
+        for (int j = 0; j < sent && !failed; j++) {
+            long body = read_response(&c);
+            if (body < 0) {
+                failed = 1;
+                res->errors += sent - j;
+                break;
+            }
+            res->latency[res->done++] = now_ns() - start;
+            res->by_method[methods[j]]++;
+            res->bytes += body + sizes[j];
+        }
+        if (sent < batch) {
+            res->errors += batch - sent;
+        }
+        i += batch;
+        // a server that said Connection: close (e.g. while draining) gets a new connection
+        if (failed || !keep_alive || c.closing) {
+            close(c.fd);
+            c.fd = -1;
+        }
+    }
+    if (c.fd >= 0) {
+        close(c.fd);
+    }
+    free(c.buf);
+    return NULL;
+}
+
+// PUT every -f file once, so GETs find them.
+static void prepare(void) {
+    Conn c = { .fd = -1, .buf = malloc(BUF_SIZE) };
+    unsigned seed = 1;
+    for (int i = 0; i < files; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s%d", path, i);
+        if ((c.fd = connect_server()) < 0 || send_request(c.fd, PUT, name, body_size(&seed), 0) < 0
+            || read_response(&c) < 0) {
+            errx(EXIT_FAILURE, "could not prepare %s", name);
+        }
+        close(c.fd);
+        c.len = 0;
+    }
+    free(c.buf);
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, long n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    long i = (long) (p * n);
+    return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+static void usage(const char *exec) {
+    errx(EXIT_FAILURE,
+        "usage: %s [-c clients] [-n requests] [-k] [-p depth] [-m get:put:append] "
+        "[-s size|min:max] [-f files] <port> <path>",
+        exec);
+}
+
+int main(int argc, char *argv[]) {
+    int clients = DEFAULT_CLIENTS;
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'c': clients = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'k': keep_alive = 1; break;
+        case 'p': depth = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &weights[GET], &weights[PUT], &weights[APPEND]) != 3
+                || weights[GET] < 0 || weights[PUT] < 0 || weights[APPEND] < 0
+                || weights[GET] + weights[PUT] + weights[APPEND] == 0) {
+                errx(EXIT_FAILURE, "bad mix: %s", optarg);
+            }
+            break;
+        case 's':
+            if (sscanf(optarg, "%ld:%ld", &min_size, &max_size) == 1) {
+                max_size = min_size;
+            }
+            if (min_size < 0 || max_size < min_size) {
+                errx(EXIT_FAILURE, "bad size: %s", optarg);
+            }
+            break;
+        case 'f': files = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc || clients <= 0 || requests <= 0 || depth <= 0 || depth > MAX_DEPTH
+        || files < 0) {
+        usage(argv[0]);
+    }
+    port = atoi(argv[optind]);
+    path = argv[optind + 1];
+    if (depth > 1) {
+        keep_alive = 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a closed connection is an error, not the end
+    payload = malloc(max_size + 1);
+    memset(payload, 'x', max_size);
+    if (files > 0) {
+        prepare();
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * clients);
+    Result *results = calloc(clients, sizeof(Result));
+    for (int i = 0; i < clients; i++) {
+        results[i].id = i;
+        results[i].latency = malloc(sizeof(uint64_t) * requests);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, client, &results[i]);
+    }
+    Result total = { 0 };
+    total.latency = malloc(sizeof(uint64_t) * clients * requests);
+    double sum = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        memcpy(total.latency + total.done, results[i].latency, sizeof(uint64_t) * results[i].done);
+        total.done += results[i].done;
+        total.errors += results[i].errors;
+        total.bytes += results[i].bytes;
+        for (int m = 0; m < METHODS; m++) {
+            total.by_method[m] += results[i].by_method[m];
+        }
+        for (long j = 0; j < results[i].done; j++) {
+            sum += results[i].latency[j];
+        }
+        free(results[i].latency);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    qsort(total.latency, total.done, sizeof(uint64_t), compare);
+
+    printf("%ld requests, %ld errors, %.3f s, %.0f req/s, mean latency %.1f us\n", total.done,
+        total.errors, elapsed, total.done / elapsed, total.done ? sum / total.done / 1e3 : 0.0);
+    printf("  GET %ld, PUT %ld, APPEND %ld; %.1f MB/s of bodies\n", total.by_method[GET],
+        total.by_method[PUT], total.by_method[APPEND], total.bytes / elapsed / 1e6);
+    printf("  latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        percentile(total.latency, total.done, 0.5), percentile(total.latency, total.done, 0.99),
+        percentile(total.latency, total.done, 0.999),
+        total.done ? total.latency[total.done - 1] / 1e3 : 0.0);
+    free(total.latency);
+    free(results);
+    free(threads);
+    free(payload);
+    return total.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
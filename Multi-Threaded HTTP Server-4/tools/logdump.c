@@ -0,0 +1,125 @@
+// Binary log decoder: prints the records of -L binary log segments as the
+// METHOD,/path,status,request-id lines the text log would have had.
+//
+// usage: logdump [-v] <segment>...
+//   -v: add the timestamp (ns since the epoch) and latency (us) to every line
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../log.h"
+
+#define OPTIONS "v"
+
+static int verbose;
+
+static const char *method_name(uint8_t method) {
+    switch (method) {
+    case LOG_GET: return "GET";
+    case LOG_PUT: return "PUT";
+    case LOG_APPEND: return "APPEND";
+    }
+    return NULL;
+}
+
+static int dump(const char *file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        warn("%s", file);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < LOG_RECORD_SIZE) {
+        warnx("%s: not a log segment", file);
+        close(fd);
+        return -1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        warn("%s", file);
+        return -1;
+    }
+    const LogHeader *h = (const LogHeader *) map;
+    if (h->kind != LOG_HEADER || memcmp(h->magic, LOG_MAGIC, sizeof(h->magic)) != 0
+        || h->record_size != LOG_RECORD_SIZE) {
+        warnx("%s: not a log segment", file);
+        munmap((void *) map, st.st_size);
+        return -1;
+    }
+
+    // every name takes at least a slot, so no id reaches the slot count
+    size_t nslots = st.st_size / LOG_RECORD_SIZE;
+    const LogName **names = calloc(nslots, sizeof(*names));
+    if (names == NULL) {
+        err(EXIT_FAILURE, "calloc");
+    }
+
+    int rc = 0;
+    for (size_t i = 1; i < nslots;) {
+        const char *slot = map + i * LOG_RECORD_SIZE;
+        if (slot[0] == LOG_NAME) {
+            const LogName *n = (const LogName *) slot;
+            if (n->id == 0 || n->id >= nslots || i + LOG_NAME_SLOTS(n->len) > nslots) {
+                warnx("%s: bad name at slot %zu", file, i);
+                rc = -1;
+                break;
+            }
+            names[n->id] = n;
+            i += LOG_NAME_SLOTS(n->len);
+        } else if (slot[0] == LOG_RESPONSE) {
+            const LogResponse *r = (const LogResponse *) slot;
+            const LogName *path = r->path_id < nslots ? names[r->path_id] : NULL;
+            const LogName *method = r->method_id < nslots ? names[r->method_id] : NULL;
+            const char *known = method_name(r->method);
+            if (path == NULL || (known == NULL && method == NULL)) {
+                warnx("%s: undefined name at slot %zu", file, i);
+                rc = -1;
+                break;
+            }
+            if (known != NULL) {
+                printf("%s", known);
+            } else {
+                printf("%.*s", (int) method->len, method->text);
+            }
+            printf(",/%.*s,%d,%d", (int) path->len, path->text, r->status, r->req_id);
+            if (verbose) {
+                printf(",%llu,%u", (unsigned long long) r->time_ns, r->latency_us);
+            }
+            putchar('\n');
+            i++;
+        } else { // LOG_END: the rest of the segment was never written
+            break;
+        }
+    }
+    free(names);
+    munmap((void *) map, st.st_size);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'v': verbose = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-v] <segment>...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-v] <segment>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int rc = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++) {
+        if (dump(argv[i]) < 0) {
+            rc = EXIT_FAILURE;
+        }
+    }
+    return rc;
+}
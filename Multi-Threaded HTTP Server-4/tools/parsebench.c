@@ -0,0 +1,113 @@
+// Parse-throughput benchmark: runs the request parser over a corpus of
+// captured request headers with every scanner implementation the CPU has.
+//
+// usage: parsebench [corpus] [iterations]
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../parser.h"
+
+#define DEFAULT_CORPUS     "tools/requests.corpus"
+#define DEFAULT_ITERATIONS 200000
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} Sample;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Split the corpus into requests at each blank line.
+static Sample *load(const char *path, size_t *count, size_t *bytes) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        err(EXIT_FAILURE, "%s", path);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(size);
+    if (fread(data, 1, size, f) != (size_t) size) {
+        errx(EXIT_FAILURE, "short read on %s", path);
+    }
+    fclose(f);
+
+    Sample *samples = NULL;
+    size_t n = 0;
+    const char *p = data, *end = data + size;
+    while (p < end) {
+        // memmem(): the corpus is not NUL-terminated and may contain NULs
+        const char *stop = memmem(p, end - p, "\r\n\r\n", 4);
+        if (stop == NULL) {
+            break;
+        }
+        samples = realloc(samples, (n + 1) * sizeof(Sample));
+        samples[n].ptr = p;
+        samples[n].len = stop + 4 - p;
+        n++;
+        p = stop + 4;
+    }
+    *count = n;
+    *bytes = p - data;
+    return samples;
+}
+
+// Checksum of what was parsed, so every implementation can be compared.
+static unsigned long parse_all(const Sample *samples, size_t count) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        Parser parser;
+        Request req;
+        memset(&req, 0, sizeof(req));
+        parser_init(&parser);
+        if (parse_request(&parser, samples[i].ptr, samples[i].len, &req) != PARSE_DONE) {
+            errx(EXIT_FAILURE, "sample %zu did not parse", i);
+        }
+        sum += req.method + req.cnt_len + req.req_id + strlen(req.path) + req.hdr_len;
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : DEFAULT_CORPUS;
+    long iterations = argc > 2 ? atol(argv[2]) : DEFAULT_ITERATIONS;
+    size_t count, bytes;
+    Sample *samples = load(path, &count, &bytes);
+    if (count == 0 || iterations <= 0) {
+        errx(EXIT_FAILURE, "usage: %s [corpus] [iterations]", argv[0]);
+    }
+    printf("%zu requests, %zu bytes, %ld iterations\n", count, bytes, iterations);
+
+    const char *impls[] = { "scalar", "sse2", "avx2" };
+    unsigned long expected = 0;
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (!scan_select(impls[k])) {
+            printf("%-8s not supported\n", impls[k]);
+            continue;
+        }
+        unsigned long sum = parse_all(samples, count);
+        if (k == 0) {
+            expected = sum;
+        } else if (sum != expected) {
+            errx(EXIT_FAILURE, "%s parsed the corpus differently", impls[k]);
+        }
+
+        double start = now();
+        for (long it = 0; it < iterations; it++) {
+            parse_all(samples, count);
+        }
+        double elapsed = now() - start;
+        double total = (double) iterations * count;
+        printf("%-8s %12.0f req/s %8.1f MB/s\n", impls[k], total / elapsed,
+            iterations * (double) bytes / elapsed / 1e6);
+    }
+    free(samples);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+// Microbenchmark: queue.c, with one shared ring and with a ring per consumer
+// (work stealing), vs. the original TAILQ + named-semaphore queue it replaced.
+//
+// usage: queuebench [producers] [consumers] [items]
+#include <sys/queue.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <err.h>
+#include <stdio.h>
+#include <time.h>
+#include "../queue.h"
+
+#define DEFAULT_PRODUCERS 1
+#define DEFAULT_CONSUMERS 4
+#define DEFAULT_ITEMS     2000000
+#define BENCH_QUEUE_SIZE  1024
+
+// ---- original queue.c, kept verbatim apart from the names ----
+TAILQ_HEAD(tailhead, connNode) head = TAILQ_HEAD_INITIALIZER(head);
+
+struct connNode {
+    int connfd;
+    TAILQ_ENTRY(connNode) entries;
+};
+
+static sem_t *sem;
+static sem_t *lock;
+
+static sem_t *make_semaphore(int value) {
+    sem_t *semaphore = sem_open("/queuebench", O_CREAT, 0644, value);
+    if (semaphore == SEM_FAILED) {
+        err(EXIT_FAILURE, "sem_open");
+    }
+    sem_unlink("/queuebench");
+    return semaphore;
+}
+
+static void legacy_createQueue(int capacity) {
+    (void) capacity;
+    sem = make_semaphore(0);
+    lock = make_semaphore(1);
+    TAILQ_INIT(&head);
+}
+
+static void legacy_destroyQueue(void) {
+    sem_close(sem);
+    sem_close(lock);
+}
+
+static void legacy_enqueue(int connfd) {
+    sem_wait(lock);
+    struct connNode *node = (struct connNode *) malloc(sizeof(struct connNode));
+    node->connfd = connfd;
+    TAILQ_INSERT_TAIL(&head, node, entries);
+    sem_post(lock);
+    sem_post(sem);
+}
+
+static int legacy_dequeue(int worker) {
+    (void) worker;
+    sem_wait(sem);
+    sem_wait(lock);
+    struct connNode *node = TAILQ_FIRST(&head);
+    int n = node->connfd;
+    TAILQ_REMOVE(&head, node, entries);
+    free(node);
+    sem_post(lock);
+    return n;
+}
+// ---- end of original queue ----
+
+static int consumers;
+
+static void shared_createQueue(int capacity) {
+    createQueue(capacity, 1);
+}
+
+static void steal_createQueue(int capacity) {
+    createQueue(capacity, consumers);
+}
+
+typedef struct {
+    const char *name;
+    void (*create)(int capacity);
+    void (*destroy)(void);
+    void (*push)(int connfd);
+    int (*pop)(int worker);
+} Impl;
+
+static const Impl impls[] = {
+    { "tailq+semaphore", legacy_createQueue, legacy_destroyQueue, legacy_enqueue, legacy_dequeue },
+    { "lock-free ring", shared_createQueue, destroyQueue, enqueue, dequeue },
+    { "work stealing", steal_createQueue, destroyQueue, enqueue, dequeue },
+};
+
+static const Impl *impl;
+static long per_producer;
+static long per_consumer;
+
+static void *producer(void *arg) {
+    (void) arg;
+    for (long i = 0; i < per_producer; i++) {
+        impl->push((int) i);
+    }
+    return NULL;
+}
+
+typedef struct {
+    int worker;
+    long sum;
+} Consumer;
+
+static void *consumer(void *arg) {
+    Consumer *c = arg;
+    for (long i = 0; i < per_consumer; i++) {
+        c->sum += impl->pop(c->worker);
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int producers = argc > 1 ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+    consumers = argc > 2 ? atoi(argv[2]) : DEFAULT_CONSUMERS;
+    long items = argc > 3 ? atol(argv[3]) : DEFAULT_ITEMS;
+    if (producers <= 0 || consumers <= 0 || items <= 0) {
+        errx(EXIT_FAILURE, "usage: %s [producers] [consumers] [items]", argv[0]);
+    }
+    // every producer/consumer handles the same share
+    per_producer = items / producers / consumers * consumers;
+    per_consumer = per_producer * producers / consumers;
+    items = per_producer * producers;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (producers + consumers));
+    Consumer *state = calloc(consumers, sizeof(Consumer));
+
+    printf("%d producers, %d consumers, %ld items\n", producers, consumers, items);
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        impl = &impls[k];
+        impl->create(BENCH_QUEUE_SIZE);
+
+        double start = now();
+        for (int i = 0; i < consumers; i++) {
+            state[i].worker = i;
+            pthread_create(&threads[producers + i], NULL, consumer, &state[i]);
+        }
+        for (int i = 0; i < producers; i++) {
+            pthread_create(&threads[i], NULL, producer, NULL);
+        }
+        for (int i = 0; i < producers + consumers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = now() - start;
+        impl->destroy();
+
+        printf("%-16s %8.3f s %12.0f ops/s\n", impl->name, elapsed, items / elapsed);
+    }
+
+    free(state);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#!/bin/bash
+# Behaviour checks against each engine: GET, PUT, APPEND, 404 with
+# Connection: close, pipelining, a staged APPEND that trickles in, a repeated
+# Content-Length, log rotation, and a hot restart (-U) that drains the old
+# server. Prints a line per failed check and exits 1 if there was any.
+#
+# usage: tools/regress.sh [port] [engine...]
+PORT=${1:-8080}
+if [ $# -ge 1 ]; then shift; fi
+ENGINES=${*:-threads epoll uring}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+trap 'kill $pid $next 2>/dev/null; rm -rf "$DIR"' EXIT
+
+cd "$DIR" || exit 1
+failures=0
+
+check() { # what expected actual
+    if [ "$2" != "$3" ]; then
+        echo "FAIL $engine: $1: expected '$2', got '$3'"
+        failures=$((failures + 1))
+    fi
+}
+
+# Send $1 (printf %b escapes) on a new connection and print all that comes
+# back until the server closes it; the last request must ask it to. A server
+# that keeps the connection open shows up as "still-open".
+exchange() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" || return
+    printf '%b' "$1" >&3
+    timeout 5 cat <&3
+    [ $? -eq 124 ] && echo "still-open"
+    exec 3<&-
+}
+statuses() {
+    # a body without a trailing newline runs into the next status line
+    exchange "$1" | grep -a -o -e 'HTTP/1\.1 [0-9]*' -e still-open | cut -d' ' -f2 | tr '\n' ' '
+}
+body() { # of a single response
+    exchange "$1" | tr -d '\r' | sed '1,/^$/d'
+}
+
+start() { # name of the pid variable, server options...
+    local var=$1
+    shift
+    "$ROOT/httpserver" -e "$engine" -l log.txt "$@" "$PORT" 2>>server.err &
+    eval "$var=$!"
+    for _ in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && return
+        sleep 0.1
+    done
+}
+
+for engine in $ENGINES; do
+    rm -f ./* .??*
+    printf 'hello\n' > a.txt
+    start pid -U handoff.sock
+
+    check "GET" "hello" "$(body 'GET /a.txt HTTP/1.1\r\nRequest-Id: 1\r\nConnection: close\r\n\r\n')"
+    check "404, Connection: close" "404 " \
+        "$(statuses 'GET /missing.txt HTTP/1.1\r\nRequest-Id: 2\r\nConnection: close\r\n\r\n')"
+    check "PUT new" "201 " \
+        "$(statuses 'PUT /b.txt HTTP/1.1\r\nRequest-Id: 3\r\nContent-Length: 3\r\nConnection: close\r\n\r\nabc')"
+    check "PUT existing" "200 " \
+        "$(statuses 'PUT /b.txt HTTP/1.1\r\nRequest-Id: 4\r\nContent-Length: 3\r\nConnection: close\r\n\r\nxyz')"
+    check "APPEND" "200 " \
+        "$(statuses 'APPEND /b.txt HTTP/1.1\r\nRequest-Id: 5\r\nContent-Length: 2\r\nConnection: close\r\n\r\n12')"
+    check "PUT+APPEND content" "xyz12" "$(cat b.txt)"
+    check "APPEND missing" "404 " \
+        "$(statuses 'APPEND /nope.txt HTTP/1.1\r\nRequest-Id: 6\r\nContent-Length: 2\r\nConnection: close\r\n\r\n12')"
+
+    # five requests in one write, answered in order on one connection
+    check "pipelining" "200 201 200 200 200 " "$(statuses 'GET /a.txt HTTP/1.1\r\nRequest-Id: 7\r\n\r\n'\
+'PUT /c.txt HTTP/1.1\r\nRequest-Id: 8\r\nContent-Length: 4\r\n\r\nc1c1'\
+'GET /c.txt HTTP/1.1\r\nRequest-Id: 9\r\n\r\n'\
+'APPEND /c.txt HTTP/1.1\r\nRequest-Id: 10\r\nContent-Length: 2\r\n\r\nc2'\
+'GET /c.txt HTTP/1.1\r\nRequest-Id: 11\r\nConnection: close\r\n\r\n')"
+    check "pipelined content" "c1c1c2" "$(cat c.txt)"
+
+    # an APPEND whose body trickles in holds no lock: a GET of the file is answered meanwhile
+    exec 4<>"/dev/tcp/127.0.0.1/$PORT"
+    printf 'APPEND /a.txt HTTP/1.1\r\nRequest-Id: 12\r\nContent-Length: 4\r\nConnection: close\r\n\r\nab' >&4
+    sleep 0.3
+    check "GET during staged APPEND" "hello" \
+        "$(body 'GET /a.txt HTTP/1.1\r\nRequest-Id: 13\r\nConnection: close\r\n\r\n')"
+    printf 'cd' >&4
+    check "staged APPEND" "200" "$(timeout 5 head -n 1 <&4 | tr -d '\r' | cut -d' ' -f2)"
+    exec 4<&-
+    check "staged APPEND content" "$(printf 'hello\nabcd')" "$(cat a.txt)"
+    check "no temp files left" "" "$(ls -A | grep '\.tmp$')"
+
+    check "conflicting Content-Length" "400 " "$(statuses 'PUT /d.txt HTTP/1.1\r\nRequest-Id: 14\r\n'\
+'Content-Length: 3\r\nContent-Length: 30\r\nConnection: close\r\n\r\nabc')"
+
+    # SIGHUP moves the log to log.txt.0 and starts a new one
+    kill -HUP "$pid"
+    sleep 0.2
+    exchange 'GET /a.txt HTTP/1.1\r\nRequest-Id: 15\r\nConnection: close\r\n\r\n' >/dev/null
+    sleep 0.2
+    check "rotated log" "1" "$(grep -a -c -x "GET,/a.txt,200,1" log.txt.0 2>&1)"
+    check "log after rotation" "GET,/a.txt,200,15" "$(cat log.txt)"
+
+    # a successor takes the listening sockets; the old server drains and exits 0
+    start next -U handoff.sock
+    wait "$pid"
+    check "old server exit status" "0" "$?"
+    check "GET after handoff" "hello" \
+        "$(body 'GET /a.txt HTTP/1.1\r\nRequest-Id: 16\r\nConnection: close\r\n\r\n' | head -n 1)"
+    kill "$next"
+    wait "$next"
+    check "drain exit status" "0" "$?"
+    pid= next=
+    PORT=$((PORT + 1))
+done
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "all passed ($ENGINES)"
@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "httpserver.h"
+#include "cache.h"
+#include "fdcache.h"
+#include "lock.h"
+#include "metrics.h"
+#include "parser.h"
+#include "uring.h"
+
+// io_uring (raw syscalls, no liburing needed):
+// https://man7.org/linux/man-pages/man7/io_uring.7.html
+// https://kernel.dk/io_uring.pdf
+
+#define RING_ENTRIES 256
+#define CHUNK_SIZE   (64 * 1024)
+#define SPARE_CHUNKS 16 // CHUNK_SIZE buffers a ring keeps for reuse
+
+// ---- minimal ring ----
+
+TAILQ_HEAD(connList, Conn);
+
+typedef struct Ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; // next SQE handed out, published to *sq_tail on submit
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // worker state that goes wherever the ring goes
+    struct connList conns; // every connection
+    struct connList waiting; // connections waiting for a path lock
+    bool accepting; // an accept is in flight
+    bool draining; // no longer accepting; returns once conns is empty
+    struct __kernel_timespec idle_close; // draining: how often to look for idle connections
+    bool tick_armed; // a retry timeout is in flight
+    struct __kernel_timespec tick;
+    char *spare[SPARE_CHUNKS]; // CHUNK_SIZE buffers of finished requests
+    int spares;
+} Ring;
+
+static void ring_init(Ring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        err(EXIT_FAILURE, "io_uring_setup");
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        err(EXIT_FAILURE, "io_uring mmap");
+    }
+
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    TAILQ_INIT(&ring->conns);
+    TAILQ_INIT(&ring->waiting);
+    ring->accepting = false;
+    ring->draining = false;
+    ring->tick_armed = false;
+    ring->tick.tv_sec = 0;
+    ring->tick.tv_nsec = 1000000;
+    ring->spares = 0;
+}
+
+// Submit everything queued so far and wait for at least wait_nr completions.
+static int ring_enter(Ring *ring, unsigned wait_nr) {
+    unsigned tail = *ring->sq_tail;
+    unsigned to_submit = ring->sqe_tail - tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    int rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+        wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return rc < 0 && errno != EINTR && errno != EBUSY ? -1 : 0;
+}
+
+// Make room for n more SQEs, pushing what we have to the kernel if the SQ is full.
+static void ring_reserve(Ring *ring, unsigned n) {
+    while (ring->sqe_tail + n - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+           > *ring->sq_mask + 1) {
+        ring_enter(ring, 0);
+    }
+}
+
+static struct io_uring_sqe *ring_sqe(Ring *ring) {
+    ring_reserve(ring, 1);
+    unsigned idx = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+// ---- connections ----
+
+typedef enum uringOp {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_STATX,
+    OP_OPEN,
+    OP_READ,
+    OP_FILL,
+    OP_WRITE,
+    OP_FSYNC,
+    OP_SEND,
+    OP_SENDMSG,
+    OP_CLOSE,
+    OP_TIMEOUT,
+    OP_TICK,
+    OP_DRAIN, // poll on the drain eventfd
+    OP_CANCEL, // of the accept, once draining
+    OP_IDLE_CLOSE, // draining: time to look for idle connections
+} uringOp;
+
+// user_data = Conn pointer | op; malloc() alignment leaves the low bits free
+#define OP_MASK 0xf
+
+typedef enum connState {
+    HEADER, // receiving the request header
+    LOCK_WAIT, // another request holds the file's lock (to open, or to commit a
+               // body once tmp_path is set); retried after every batch
+    LOOKUP, // -F: GET statx in flight; a cache miss opens the file afterwards
+    OPENING, // statx + openat in flight
+    BODY, // receiving the PUT/APPEND body, writing it to the file, syncing it
+    SENDING, // sending a response (and the GET body after it)
+} connState;
+
+typedef struct Conn {
+    int fd;
+    connState state;
+    bool served; // has answered a request
+    uint64_t idle_since; // when it answered the last one (ns)
+    TAILQ_ENTRY(Conn) link; // on the ring's conns list
+    TAILQ_ENTRY(Conn) wait; // on the ring's waiting list
+
+    char buf[BUF_SIZE]; // request header, start of the body, maybe pipelined requests
+    size_t len;
+    struct __kernel_timespec idle; // linked to every recv from the client
+
+    // Everything from here on belongs to the current request; next_request()
+    // clears it.
+    Request req;
+    Parser parser;
+
+    int pending; // OPENING: completions still outstanding
+    int stat_res;
+    struct statx stx;
+    unsigned long version; // -F: fdcache_version() before the statx
+    int file; // or -errno while OPENING
+    int status;
+
+    char *io; // CHUNK_SIZE staging buffer (chunk_get()), only while a request needs it
+    char *ahead; // GET: second CHUNK_SIZE buffer, the next chunk is read into it
+                 // while io is sent
+    size_t ahead_len; // bytes in it
+    bool reading; // GET: a read into ahead is in flight
+    bool failed; // GET: a read or send failed; close once the other completes
+    const char *wr; // bytes being written to the file or sent: io, the header
+                    // buffer, or a prebuilt status reply
+    size_t io_len; // bytes at wr to send or write
+    size_t io_done; // bytes of those already sent or written
+    off_t offset; // GET: next file byte to read
+    size_t remaining; // BODY: body bytes still expected
+
+    CacheEntry *fill; // GET: cache entry being read from the file
+    CacheEntry *hit; // GET: cached response being sent instead of io
+    size_t hit_off; // bytes of it already sent
+    struct iovec iov[CACHE_IOV];
+    struct msghdr msg;
+
+    uint64_t disk_since; // submission (or previous completion) of the file system op in flight
+} Conn;
+
+static const uint8_t opcodes[] = {
+    [OP_ACCEPT] = IORING_OP_ACCEPT,
+    [OP_RECV] = IORING_OP_RECV,
+    [OP_STATX] = IORING_OP_STATX,
+    [OP_OPEN] = IORING_OP_OPENAT,
+    [OP_READ] = IORING_OP_READ,
+    [OP_FILL] = IORING_OP_READ,
+    [OP_WRITE] = IORING_OP_WRITE,
+    [OP_FSYNC] = IORING_OP_FSYNC,
+    [OP_SEND] = IORING_OP_SEND,
+    [OP_SENDMSG] = IORING_OP_SENDMSG,
+    [OP_CLOSE] = IORING_OP_CLOSE,
+    [OP_TIMEOUT] = IORING_OP_LINK_TIMEOUT,
+    [OP_TICK] = IORING_OP_TIMEOUT,
+    [OP_DRAIN] = IORING_OP_POLL_ADD,
+    [OP_CANCEL] = IORING_OP_ASYNC_CANCEL,
+    [OP_IDLE_CLOSE] = IORING_OP_TIMEOUT,
+};
+
+static struct io_uring_sqe *prep(Ring *ring, uringOp op, Conn *c, int fd, const void *addr,
+    unsigned len, uint64_t off) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = opcodes[op];
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t) c | op;
+    if (op == OP_STATX || op == OP_OPEN || op == OP_FILL || op == OP_FSYNC) {
+        c->disk_since = metrics_now();
+    }
+    return sqe;
+}
+
+// A file system op completed: its time (since submission, or since the op it
+// is linked behind completed) goes to the request's disk time.
+static void disk_done(Conn *c) {
+    uint64_t now = metrics_now();
+    c->req.disk_ns += now - c->disk_since;
+    c->disk_since = now;
+}
+
+// Chunks go back to the ring rather than to free(): freeing a GET's two at once
+// makes malloc trim the top of the heap, and the next GET faults it back in.
+static char *chunk_get(Ring *ring) {
+    return ring->spares > 0 ? ring->spare[--ring->spares] : malloc(CHUNK_SIZE);
+}
+
+static void chunk_put(Ring *ring, char *chunk) {
+    if (chunk != NULL && ring->spares < SPARE_CHUNKS) {
+        ring->spare[ring->spares++] = chunk;
+    } else {
+        free(chunk);
+    }
+}
+
+static char *conn_io(Ring *ring, Conn *c) {
+    if (c->io == NULL) {
+        c->io = chunk_get(ring);
+    }
+    return c->io;
+}
+
+static void conn_close(Ring *ring, Conn *c) {
+    TAILQ_REMOVE(&ring->conns, c, link);
+    unlock_request(&c->req);
+    close(c->fd);
+    if (c->req.open_file != NULL) {
+        fdcache_release(c->req.open_file);
+    } else if (c->file >= 0) {
+        close(c->file);
+    }
+    if (c->fill != NULL) {
+        cache_release(c->fill);
+    }
+    if (c->hit != NULL) {
+        cache_release(c->hit);
+    }
+    remove_temp(&c->req);
+    chunk_put(ring, c->io);
+    chunk_put(ring, c->ahead);
+    free(c);
+}
+
+static void close_file(Ring *ring, Conn *c) {
+    if (c->req.open_file != NULL) { // -F: the cache's descriptor stays open
+        fdcache_release(c->req.open_file);
+        c->req.open_file = NULL;
+        c->file = -1;
+    } else if (c->file >= 0) {
+        prep(ring, OP_CLOSE, NULL, c->file, NULL, 0, 0);
+        c->file = -1;
+    }
+}
+
+// Receive from the client; an idle client cancels the recv, which then fails
+// and closes the connection. The timeout's own completion carries no Conn.
+static void recv_client(Ring *ring, Conn *c, void *buf, size_t len) {
+    ring_reserve(ring, 2); // a link must not be split across two submits
+    struct io_uring_sqe *sqe = prep(ring, OP_RECV, c, c->fd, buf, len, 0);
+    if (idle_timeout > 0) {
+        sqe->flags = IOSQE_IO_LINK;
+        c->idle.tv_sec = idle_timeout;
+        prep(ring, OP_TIMEOUT, NULL, -1, &c->idle, 1, 0);
+    }
+}
+
+static void send_io(Ring *ring, Conn *c) {
+    prep(ring, OP_SEND, c, c->fd, c->wr + c->io_done, c->io_len - c->io_done, 0);
+}
+
+// Send (the rest of) a cached response: header and body in one sendmsg.
+static void send_cached(Ring *ring, Conn *c) {
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = cache_iov(c->hit, c->req.conn_close, c->hit_off, c->iov);
+    prep(ring, OP_SENDMSG, c, c->fd, &c->msg, 1, 0);
+}
+
+static void respond(Ring *ring, Conn *c, int status) {
+    close_file(ring, c);
+    Slice reply = status_response(&c->req, status);
+    c->wr = reply.ptr;
+    c->io_len = reply.len;
+    c->io_done = 0;
+    c->state = SENDING;
+    send_io(ring, c);
+}
+
+// Read the next piece of the GET body into ahead, behind whatever is already there.
+static void read_ahead(Ring *ring, Conn *c) {
+    size_t left = c->req.read_len - c->offset;
+    size_t room = CHUNK_SIZE - c->ahead_len;
+    prep(ring, OP_READ, c, c->file, c->ahead + c->ahead_len, left < room ? left : room, c->offset);
+    c->reading = true;
+}
+
+static void parse_header(Ring *ring, Conn *c);
+
+// The current request is done: keep the bytes that follow it (a pipelined
+// request) and start over.
+static void next_request(Ring *ring, Conn *c) {
+    unlock_request(&c->req);
+    metrics_done(&c->req);
+    if (c->req.conn_close) {
+        conn_close(ring, c);
+        return;
+    }
+    size_t used = request_size(&c->req);
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+    c->served = true;
+    c->idle_since = metrics_now();
+    close_file(ring, c);
+    chunk_put(ring, c->io);
+    chunk_put(ring, c->ahead);
+    memset(&c->req, 0, sizeof(Conn) - offsetof(Conn, req));
+    c->file = -1;
+    c->req.socket = c->fd;
+    parser_init(&c->parser);
+    parse_header(ring, c);
+}
+
+// A read or a send of a GET body (or a reply's send) completed. Once neither
+// is in flight, swap the buffers: send what was read ahead and read the next
+// chunk into the buffer just sent, so the disk and the socket work in parallel.
+static void stream_next(Ring *ring, Conn *c) {
+    if (c->reading || c->io_done < c->io_len) {
+        return; // the other one comes back here when it completes
+    }
+    if (c->failed) {
+        conn_close(ring, c);
+        return;
+    }
+    if (c->ahead_len == 0) {
+        next_request(ring, c);
+        return;
+    }
+    char *sent = c->io;
+    c->io = c->ahead;
+    c->ahead = sent;
+    c->wr = c->io;
+    c->io_len = c->ahead_len;
+    c->io_done = 0;
+    c->ahead_len = 0;
+    send_io(ring, c);
+    if (c->offset < c->req.read_len) {
+        read_ahead(ring, c);
+    }
+}
+
+static void open_request(Ring *ring, Conn *c);
+
+static void send_get(Ring *ring, Conn *c, const struct stat *st);
+
+static void complete_fill(Ring *ring, Conn *c);
+
+static void start_request(Ring *ring, Conn *c) {
+    if (c->req.method != PUT && c->req.method != APPEND) {
+        discard_body(&c->req);
+    }
+    if (!check_format(&c->req)) {
+        respond(ring, c, 400);
+        return;
+    }
+    if (c->req.method != GET && c->req.method != PUT && c->req.method != APPEND) {
+        respond(ring, c, 501);
+        return;
+    }
+    open_request(ring, c);
+}
+
+// Lock the file, then stat and open it. The worker must never block, so a busy
+// lock parks the connection until the next batch of completions. A staged body
+// (body_staged()) goes to a fresh temp file instead and needs no lock until
+// commit_body(); an APPEND's statx checks ahead that there is a file to add to.
+static void open_request(Ring *ring, Conn *c) {
+    if (body_staged(&c->req)) {
+        make_temp_path(&c->req);
+        c->pending = 1;
+        if (c->req.method == APPEND) {
+            struct io_uring_sqe *sqe = prep(ring, OP_STATX, c, AT_FDCWD, c->req.path,
+                STATX_TYPE, (uintptr_t) &c->stx);
+            sqe->flags = IOSQE_IO_HARDLINK;
+            c->pending = 2;
+        }
+        struct io_uring_sqe *sqe = prep(ring, OP_OPEN, c, AT_FDCWD, c->req.tmp_path, 0666, 0);
+        sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+        c->state = OPENING;
+        return;
+    }
+    if (metrics_request(&c->req) && (c->hit = metrics_reply()) != NULL) {
+        log_response(&c->req, 200);
+        c->state = SENDING;
+        c->hit_off = 0;
+        send_cached(ring, c);
+        return;
+    }
+    if (!trylock_request(&c->req)) {
+        c->state = LOCK_WAIT;
+        TAILQ_INSERT_TAIL(&ring->waiting, c, wait);
+        return;
+    }
+    if (c->req.method == GET && fdcache_enabled()) {
+        c->version = fdcache_version(c->req.path);
+        // with -I an open file is as inotify left it, no statx or openat needed
+        if (fdcache_watching() && (c->req.open_file = fdcache_lookup(c->req.path, NULL)) != NULL) {
+            c->file = c->req.open_file->fd;
+            send_get(ring, c, &c->req.open_file->st);
+            return;
+        }
+    }
+
+    // statx tells GET the size and APPEND whether the file existed;
+    // the hard link keeps it ahead of the open even when it fails.
+    struct io_uring_sqe *sqe = prep(ring, OP_STATX, c, AT_FDCWD, c->req.path,
+        STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME, (uintptr_t) &c->stx);
+    if (c->req.method == GET && fdcache_enabled() && !fdcache_watching()) {
+        c->pending = 1; // looked_up() decides whether to open
+        c->state = LOOKUP;
+        return;
+    }
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = prep(ring, OP_OPEN, c, AT_FDCWD, c->req.path, 0666, 0);
+    sqe->open_flags = c->req.method == GET ? O_RDONLY : O_WRONLY | O_APPEND;
+
+    c->pending = 2;
+    c->state = OPENING;
+}
+
+// The body is in its temp file: commit it (rename or copy) under the path lock.
+static void commit_body(Ring *ring, Conn *c) {
+    if (!trylock_request(&c->req)) {
+        c->state = LOCK_WAIT;
+        TAILQ_INSERT_TAIL(&ring->waiting, c, wait);
+        return;
+    }
+    respond(ring, c, commit_temp(&c->req));
+}
+
+// The whole body is stored (and synced, res < 0 if that failed): commit or reply.
+static void body_done(Ring *ring, Conn *c, int res) {
+    if (res < 0) {
+        c->status = 500;
+        remove_temp(&c->req);
+    }
+    close_file(ring, c);
+    if (c->req.tmp_path[0] != '\0') {
+        commit_body(ring, c);
+    } else {
+        respond(ring, c, c->status);
+    }
+}
+
+// Body bytes in c->io (or the header buffer) have been stored; get more or finish.
+static void body_next(Ring *ring, Conn *c) {
+    if (c->remaining > 0) {
+        size_t want = c->remaining < CHUNK_SIZE ? c->remaining : CHUNK_SIZE;
+        recv_client(ring, c, conn_io(ring, c), want);
+        return;
+    }
+    if (sync_mode == SYNC_NONE || (c->req.method == APPEND && c->req.tmp_path[0] != '\0')) {
+        body_done(ring, c, 0); // a staged APPEND is synced by commit_temp(), after the copy
+        return;
+    }
+    struct io_uring_sqe *sqe = prep(ring, OP_FSYNC, c, c->file, NULL, 0, 0);
+    sqe->fsync_flags = sync_mode == SYNC_DATA ? IORING_FSYNC_DATASYNC : 0;
+}
+
+static void write_body(Ring *ring, Conn *c, const char *data, size_t len) {
+    c->wr = data;
+    c->io_len = len;
+    c->io_done = 0;
+    prep(ring, OP_WRITE, c, c->file, data, len, (uint64_t) -1);
+}
+
+// The parts of the statx result the caches compare.
+static void stx_stat(const Conn *c, struct stat *st) {
+    *st = (struct stat) {
+        .st_dev = makedev(c->stx.stx_dev_major, c->stx.stx_dev_minor),
+        .st_ino = c->stx.stx_ino,
+        .st_size = c->stx.stx_size,
+        .st_mtim = { .tv_sec = c->stx.stx_mtime.tv_sec, .tv_nsec = c->stx.stx_mtime.tv_nsec },
+    };
+}
+
+// Answer a GET whose file is open (or from the -F cache, if open_file is set).
+// A content cache hit is sent from memory, a small miss is read into a new
+// entry (OP_FILL) and sent from there, a -m mapping is looked up or made, and
+// anything else is streamed, from an -F descriptor kept open for the next GET.
+static void send_get(Ring *ring, Conn *c, const struct stat *st) {
+    c->req.read_len = st->st_size;
+    c->state = SENDING;
+    c->hit_off = 0;
+
+    if (c->req.open_file == NULL) {
+        if ((c->hit = cache_lookup(c->req.path, st)) != NULL
+            || (c->hit = cache_map_lookup(st)) != NULL
+            || (cache_map_admits(st->st_size) && (c->hit = cache_map(c->file, st)) != NULL)) {
+            log_response(&c->req, 200);
+            close_file(ring, c);
+            send_cached(ring, c);
+            return;
+        }
+        if (cache_admits(st->st_size) && (c->fill = cache_alloc(c->req.path, st)) != NULL) {
+            log_response(&c->req, 200);
+            c->offset = 0;
+            if (st->st_size == 0) {
+                complete_fill(ring, c);
+            } else {
+                prep(ring, OP_FILL, c, c->file, c->fill->body, st->st_size, 0);
+            }
+            return;
+        }
+        if (fdcache_enabled() && !cache_admits(st->st_size) && !cache_map_admits(st->st_size)) {
+            c->req.open_file = fdcache_insert(c->req.path, c->file, st, c->version);
+        }
+    }
+
+    // header and first chunk of the file leave in one send
+    conn_io(ring, c);
+    c->ahead = chunk_get(ring);
+    c->ahead_len = get_response(&c->req, c->ahead);
+    c->offset = 0;
+    if (c->req.read_len > 0) {
+        read_ahead(ring, c);
+    } else {
+        stream_next(ring, c);
+    }
+}
+
+// The whole file is in c->fill: publish it and send it.
+static void complete_fill(Ring *ring, Conn *c) {
+    cache_insert(c->fill);
+    c->hit = c->fill;
+    c->fill = NULL;
+    close_file(ring, c);
+    send_cached(ring, c);
+}
+
+// -F: the GET's statx has completed. A file that neither the content cache nor
+// the mappings take is looked up among the open files; anything else (or a
+// miss) is opened now and goes through send_get() as usual.
+static void looked_up(Ring *ring, Conn *c) {
+    struct stat st;
+    stx_stat(c, &st);
+    if (c->stat_res == 0 && S_ISREG(c->stx.stx_mode) && !cache_admits(st.st_size)
+        && !cache_map_admits(st.st_size)
+        && (c->req.open_file = fdcache_lookup(c->req.path, &st)) != NULL) {
+        c->file = c->req.open_file->fd;
+        send_get(ring, c, &c->req.open_file->st);
+        return;
+    }
+    struct io_uring_sqe *sqe = prep(ring, OP_OPEN, c, AT_FDCWD, c->req.path, 0666, 0);
+    sqe->open_flags = O_RDONLY;
+    c->pending = 1;
+    c->state = OPENING;
+}
+
+// Both statx and openat have completed: same decisions as open_get()/open_put_append().
+static void opened(Ring *ring, Conn *c) {
+    int open_err = c->file < 0 ? -c->file : 0;
+    if (open_err) {
+        c->file = -1;
+    }
+
+    if (c->req.method == GET) {
+        if (open_err) {
+            respond(ring, c, open_err == ENOENT ? 404 : 403);
+        } else if (c->stat_res < 0) {
+            respond(ring, c, 500);
+        } else if (!S_ISREG(c->stx.stx_mode)) {
+            respond(ring, c, 403);
+        } else {
+            struct stat st;
+            stx_stat(c, &st);
+            send_get(ring, c, &st);
+        }
+        return;
+    }
+
+    bool staged = c->req.tmp_path[0] != '\0';
+    c->status = c->stat_res == 0 ? 200 : 201; // in place; a staged body's comes from commit_temp()
+    if (!open_err && staged && c->req.method == APPEND && c->stat_res < 0) {
+        close_file(ring, c); // no file to add to: the temp file is not needed
+        remove_temp(&c->req);
+        open_err = -c->stat_res;
+        staged = false;
+    }
+    if (open_err) {
+        c->req.tmp_path[0] = '\0'; // never created, or removed
+        discard_body(&c->req);
+        if (staged) {
+            respond(ring, c, 500);
+        } else if (open_err == ENOENT) {
+            respond(ring, c, 404);
+        } else {
+            next_request(ring, c);
+        }
+        return;
+    }
+    if (c->req.method == APPEND && !staged) {
+        cache_invalidate(c->req.path);
+        fdcache_invalidate(c->req.path);
+    }
+
+    size_t buffered = c->req.bdy_len < c->req.cnt_len ? c->req.bdy_len : c->req.cnt_len;
+    c->remaining = c->req.cnt_len - buffered;
+    c->state = BODY;
+    if (buffered > 0) {
+        write_body(ring, c, c->req.msg_bdy, buffered);
+    } else {
+        body_next(ring, c);
+    }
+}
+
+// Parse what has arrived so far; receive more if the header is incomplete.
+static void parse_header(Ring *ring, Conn *c) {
+    c->state = HEADER;
+    parseResult rc = metrics_parse(&c->parser, c->buf, c->len, &c->req);
+    if (rc == PARSE_DONE) {
+        start_request(ring, c);
+    } else if (rc == PARSE_ERROR || c->len == BUF_SIZE) {
+        c->req.conn_close = true; // the next request cannot be found
+        respond(ring, c, 400);
+    } else {
+        recv_client(ring, c, c->buf + c->len, BUF_SIZE - c->len);
+    }
+}
+
+static void complete(Ring *ring, Conn *c, uringOp op, int res) {
+    switch (op) {
+    case OP_RECV:
+        if (res <= 0) {
+            conn_close(ring, c);
+            return;
+        }
+        if (c->state == BODY) {
+            c->remaining -= res;
+            write_body(ring, c, c->io, res);
+            return;
+        }
+        c->len += res;
+        parse_header(ring, c);
+        return;
+
+    case OP_STATX:
+    case OP_OPEN:
+        disk_done(c);
+        if (op == OP_STATX) {
+            c->stat_res = res;
+        } else {
+            c->file = res;
+        }
+        if (--c->pending > 0) {
+            return;
+        }
+        if (c->state == LOOKUP) {
+            looked_up(ring, c);
+        } else {
+            opened(ring, c);
+        }
+        return;
+
+    case OP_READ:
+        c->reading = false;
+        if (res <= 0) { // file shrank underneath us
+            c->failed = true;
+        } else {
+            c->ahead_len += res;
+            c->offset += res;
+        }
+        stream_next(ring, c);
+        return;
+
+    case OP_FSYNC:
+        disk_done(c);
+        body_done(ring, c, res);
+        return;
+
+    case OP_FILL:
+        disk_done(c);
+        if (res <= 0) { // file shrank underneath us
+            conn_close(ring, c);
+            return;
+        }
+        c->offset += res;
+        if (c->offset < c->fill->size) {
+            prep(ring, OP_FILL, c, c->file, c->fill->body + c->offset,
+                c->fill->size - c->offset, c->offset);
+            return;
+        }
+        complete_fill(ring, c);
+        return;
+
+    case OP_SENDMSG:
+        if (res < 0) {
+            conn_close(ring, c);
+            return;
+        }
+        c->hit_off += res;
+        if (c->hit_off < cache_reply_len(c->hit, c->req.conn_close)) {
+            send_cached(ring, c);
+            return;
+        }
+        cache_release(c->hit);
+        c->hit = NULL;
+        next_request(ring, c);
+        return;
+
+    case OP_WRITE:
+        if (res < 0) {
+            remove_temp(&c->req);
+            c->req.conn_close = true; // rest of the body is still on the wire
+            respond(ring, c, 500);
+            return;
+        }
+        c->io_done += res;
+        if (c->io_done < c->io_len) {
+            prep(ring, OP_WRITE, c, c->file, c->wr + c->io_done, c->io_len - c->io_done,
+                (uint64_t) -1);
+            return;
+        }
+        body_next(ring, c);
+        return;
+
+    case OP_SEND:
+        if (res < 0) {
+            c->failed = true;
+            c->io_done = c->io_len;
+        } else if ((c->io_done += res) < c->io_len) {
+            send_io(ring, c);
+            return;
+        }
+        stream_next(ring, c);
+        return;
+
+    default: return;
+    }
+}
+
+static void new_conn(Ring *ring, int fd) {
+    Conn *c = calloc(1, sizeof(Conn));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->file = -1;
+    c->req.socket = fd;
+    parser_init(&c->parser);
+    TAILQ_INSERT_TAIL(&ring->conns, c, link);
+    parse_header(ring, c);
+}
+
+// The drain started: cancel the accept and take what is left in the backlog
+// (the listener is non-blocking), then look for idle connections ten times per
+// DRAIN_IDLE_MS.
+static void stop_accepting(Ring *ring, int listenfd) {
+    ring->draining = true;
+    prep(ring, OP_CANCEL, NULL, -1, (void *) (uintptr_t) OP_ACCEPT, 0, 0);
+    for (int i = 0; i < LISTEN_BACKLOG; i++) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            break;
+        }
+        new_conn(ring, fd);
+    }
+    ring->idle_close.tv_sec = DRAIN_IDLE_MS / 10 / 1000;
+    ring->idle_close.tv_nsec = DRAIN_IDLE_MS / 10 % 1000 * 1000000L;
+    prep(ring, OP_IDLE_CLOSE, NULL, -1, &ring->idle_close, 1, 0);
+}
+
+// End the connections idle between requests for DRAIN_IDLE_MS by shutting down
+// their read side, which completes their recv.
+static void close_idle(Ring *ring) {
+    uint64_t now = metrics_now();
+    Conn *c;
+    TAILQ_FOREACH(c, &ring->conns, link) {
+        if (c->state == HEADER && c->len == 0 && c->served
+            && now - c->idle_since >= (uint64_t) DRAIN_IDLE_MS * 1000000) {
+            shutdown(c->fd, SHUT_RD);
+        }
+    }
+    if (!TAILQ_EMPTY(&ring->conns)) {
+        prep(ring, OP_IDLE_CLOSE, NULL, -1, &ring->idle_close, 1, 0);
+    }
+}
+
+void *uring_worker(void *arg) {
+    int listenfd = *(int *) arg;
+    Ring ring;
+    ring_init(&ring, RING_ENTRIES);
+
+    prep(&ring, OP_ACCEPT, NULL, listenfd, NULL, 0, 0);
+    ring.accepting = true;
+    prep(&ring, OP_DRAIN, NULL, drain_fd(), NULL, 0, 0)->poll32_events = POLLIN;
+    while (!ring.draining || ring.accepting || !TAILQ_EMPTY(&ring.conns)) {
+        if (ring_enter(&ring, 1) < 0) {
+            err(EXIT_FAILURE, "io_uring_enter");
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            Conn *c = (Conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+            uringOp op = cqe->user_data & OP_MASK;
+            int res = cqe->res;
+
+            if (op == OP_TICK) {
+                ring.tick_armed = false;
+            } else if (op == OP_DRAIN) {
+                stop_accepting(&ring, listenfd);
+            } else if (op == OP_IDLE_CLOSE) {
+                close_idle(&ring);
+            } else if (op == OP_ACCEPT) {
+                if (ring.draining) {
+                    ring.accepting = false; // cancelled (or raced the cancel)
+                    stopped_accepting();
+                } else {
+                    prep(&ring, OP_ACCEPT, NULL, listenfd, NULL, 0, 0);
+                }
+                if (res >= 0) {
+                    new_conn(&ring, res);
+                }
+            } else if (c != NULL) {
+                complete(&ring, c, op, res);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // retry the connections whose file was locked; a timeout keeps
+        // ring_enter() from sleeping while any are still waiting
+        struct connList retry = TAILQ_HEAD_INITIALIZER(retry);
+        TAILQ_CONCAT(&retry, &ring.waiting, wait);
+        Conn *c;
+        while ((c = TAILQ_FIRST(&retry)) != NULL) {
+            TAILQ_REMOVE(&retry, c, wait);
+            if (c->req.tmp_path[0] != '\0') {
+                commit_body(&ring, c);
+            } else {
+                open_request(&ring, c);
+            }
+        }
+        if (!TAILQ_EMPTY(&ring.waiting) && !ring.tick_armed) {
+            prep(&ring, OP_TICK, NULL, -1, &ring.tick, 1, 0);
+            ring.tick_armed = true;
+        }
+    }
+    ring_enter(&ring, 0); // the last file closes
+    close(ring.fd);
+    while (ring.spares > 0) {
+        free(ring.spare[--ring.spares]);
+    }
+    return NULL;
+}
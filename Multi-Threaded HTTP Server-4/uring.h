@@ -0,0 +1,5 @@
+// io_uring engine (-e uring): every worker owns a submission/completion ring
+// and drives its connections from completions, batching accept, recv,
+// statx/openat, read/write and send into one io_uring_enter() per loop.
+// arg points at the listening socket.
+void *uring_worker(void *arg);